@@ -0,0 +1,551 @@
+#include <Ice/Ice.h>
+#include <SIP.h>
+#include <Servants.h>
+#include <MPK.h>
+#include <Tram.h>
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace SIP;
+
+// Load generator. The servants run in MPK.Bench.Servers child processes:
+// the first one hosts the MPK registry and the line factory, every one a
+// stop factory registered with it, so stops are placed over the servers by
+// the registry. The parent creates the network through MPK and drives
+// thousands of TramImpls and passengers over loopback TCP. A tram move
+// sends the arrivals of the rest of its line, one batch per server;
+// passengers record how long after the move each arrival reaches them.
+// CPU and memory are measured in the servers alone, and every counter is
+// taken over the measured window, after the warmup.
+//
+// Everything is set through properties, e.g.
+//   ./benchmark --MPK.Bench.Trams=5000 --MPK.Bench.Rate=20000
+//
+// The arrival time sent for move m of a tram is base + m * 1000 + k for a
+// stop k ms down the line (the running time between stops is 1 ms), which
+// tells a passenger which move it is looking at.
+
+static Ice::Long steadyMicros() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct BenchConfig {
+    int stops, lines, stopsPerLine, trams, passengers, stopsPerPassenger;
+    int servers, rate, seconds, warmupSeconds, drivers, seed;
+    bool batch;
+
+    explicit BenchConfig(const Ice::PropertiesPtr &props) {
+        stops = max(props->getPropertyAsIntWithDefault("MPK.Bench.Stops", 200), 1);
+        lines = max(props->getPropertyAsIntWithDefault("MPK.Bench.Lines", 20), 1);
+        // the arrival encoding allows lines of up to 1000 stops
+        stopsPerLine = min(max(props->getPropertyAsIntWithDefault("MPK.Bench.StopsPerLine", 15), 2), min(stops, 1000));
+        trams = max(props->getPropertyAsIntWithDefault("MPK.Bench.Trams", 1000), 1);
+        passengers = max(props->getPropertyAsIntWithDefault("MPK.Bench.Passengers", 2000), 0);
+        stopsPerPassenger = min(max(props->getPropertyAsIntWithDefault("MPK.Bench.StopsPerPassenger", 3), 1), stops);
+        servers = max(props->getPropertyAsIntWithDefault("MPK.Bench.Servers", 2), 1);
+        rate = max(props->getPropertyAsIntWithDefault("MPK.Bench.Rate", 2000), 1);
+        seconds = max(props->getPropertyAsIntWithDefault("MPK.Bench.Seconds", 10), 1);
+        warmupSeconds = max(props->getPropertyAsIntWithDefault("MPK.Bench.WarmupSeconds", 1), 0);
+        drivers = max(props->getPropertyAsIntWithDefault("MPK.Bench.Drivers", 2), 1);
+        seed = props->getPropertyAsIntWithDefault("MPK.Bench.Seed", 1);
+        batch = props->getPropertyAsIntWithDefault("MPK.Bench.Batch", 0) > 0;
+    }
+};
+
+// Move times of every tram and the latencies passengers saw, in microseconds.
+class Recorder {
+    static const int ring = 256;
+
+    Ice::Long base;
+    unique_ptr<atomic<Ice::Long>[]> sent;
+    atomic<bool> recording{false};
+    atomic<Ice::Long> moves{0};
+
+    mutex mtx;
+    vector<Ice::Long> latencies;
+    Ice::Long callbacks = 0;
+    Ice::Long arrivals = 0;
+
+public:
+    Recorder(Ice::Long b, int trams) : base(b), sent(new atomic<Ice::Long>[static_cast<size_t>(trams) * ring]) {
+        for (size_t i = 0; i < static_cast<size_t>(trams) * ring; i++)
+            sent[i].store(0, memory_order_relaxed);
+    }
+
+    Ice::Long arrivalTime(Ice::Long move, int stop) const {
+        return base + move * 1000 + stop;
+    }
+
+    void start() {
+        recording = true;
+    }
+
+    void stop() {
+        recording = false;
+    }
+
+    void moved(int tram, Ice::Long move) {
+        sent[static_cast<size_t>(tram) * ring + move % ring].store(steadyMicros(), memory_order_relaxed);
+        if (recording)
+            moves++;
+    }
+
+    void arrived(const TramList &upserts) {
+        if (!recording)
+            return;
+        Ice::Long now = steadyMicros();
+        vector<Ice::Long> seen;
+        seen.reserve(upserts.size());
+        for (const auto &info : upserts) {
+            const string &name = info.tram->ice_getIdentity().name;
+            Ice::Long move = (info.time.ms - base) / 1000;
+            if (name.size() <= 4 || move < 0)
+                continue;
+            size_t tram = stoul(name.substr(4));
+            Ice::Long at = sent[tram * ring + move % ring].load(memory_order_relaxed);
+            if (at > 0)
+                seen.push_back(now - at);
+        }
+        lock_guard<mutex> lock(mtx);
+        callbacks++;
+        arrivals += upserts.size();
+        latencies.insert(latencies.end(), seen.begin(), seen.end());
+    }
+
+    Ice::Long moveCount() const {
+        return moves;
+    }
+
+    void report(double seconds) {
+        lock_guard<mutex> lock(mtx);
+        cout << "callbacks: " << callbacks << " (" << callbacks / seconds << "/s)" << endl;
+        cout << "arrivals delivered: " << arrivals << " (" << arrivals / seconds << "/s)" << endl;
+        if (latencies.empty()) {
+            cout << "latency: no samples" << endl;
+            return;
+        }
+        sort(latencies.begin(), latencies.end());
+        auto percentile = [this](double p) {
+            size_t i = min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()));
+            return latencies[i] / 1000.0;
+        };
+        cout << "latency move->notification: p50 " << percentile(0.50) << " ms, p99 " << percentile(0.99)
+             << " ms, p999 " << percentile(0.999) << " ms (" << latencies.size() << " samples)" << endl;
+    }
+};
+
+class BenchPassenger : public Passenger {
+    Recorder &recorder;
+public:
+    BenchPassenger(Recorder &r) : recorder(r) {}
+
+    virtual void updateTramInfo(const TramPrx&, const StopList&, const Ice::Current& = Ice::Current()) override {}
+
+    virtual void updateStopInfo(const TramStopPrx&, const TramList &trams, const Ice::Current& = Ice::Current()) override {
+        recorder.arrived(trams);
+    }
+
+    virtual void updateStopDelta(const TramStopPrx&, Ice::Long, const TramList &upserts, const TramSeq&, const Ice::Current& = Ice::Current()) override {
+        recorder.arrived(upserts);
+    }
+
+    virtual void updateStopInfoBatch(const StopBoardList &boards, const Ice::Current& = Ice::Current()) override {
+        TramList upserts;
+        for (const auto &b : boards)
+            upserts.insert(upserts.end(), b.upserts.begin(), b.upserts.end());
+        recorder.arrived(upserts);
+    }
+};
+
+// A TramImpl whose arrival time names the move, so passengers can tell
+// which move they see. The rest of the line is updated like any tram does,
+// one oneway batch per server process.
+class BenchTram : public TramImpl {
+    Recorder &recorder;
+    int index;
+    Ice::Long move = 0;
+
+public:
+    BenchTram(Recorder &r, int i) : TramImpl(to_string(i)), recorder(r), index(i) {}
+
+    virtual Timestamp getCurrentTime() override {
+        return timestamp(recorder.arrivalTime(move, 0));
+    }
+
+    // at the end of the line the tram starts over from its first stop
+    void step() {
+        move++;
+        recorder.moved(index, move);
+        if (!moveToNextStop()) {
+            setLine(getLine());
+            moveToNextStop();
+        }
+    }
+};
+
+// moves the trams with index % drivers == id, config.rate / drivers per second
+static void drive(const vector<BenchTram*> &trams, const BenchConfig &config, int id, const atomic<bool> &running) {
+    vector<BenchTram*> mine;
+    for (size_t i = id; i < trams.size(); i += config.drivers)
+        mine.push_back(trams[i]);
+    if (mine.empty())
+        return;
+
+    double rate = static_cast<double>(config.rate) / config.drivers;
+    auto start = chrono::steady_clock::now();
+    Ice::Long done = 0;
+    size_t next = 0;
+    while (running) {
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        Ice::Long due = static_cast<Ice::Long>(elapsed * rate);
+        for (; done < due && running; done++) {
+            mine[next]->step();
+            next = (next + 1) % mine.size();
+        }
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+}
+
+struct Usage {
+    double cpuSeconds;
+    long maxRssKb;
+};
+
+static Usage usage() {
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    Usage u;
+    u.cpuSeconds = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    u.maxRssKb = ru.ru_maxrss;
+    return u;
+}
+
+static long currentRssKb() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static Ice::InitializationData initData(const Ice::PropertiesPtr &props) {
+    Ice::InitializationData data;
+    data.properties = props;
+    // callbacks to thousands of passengers and their dispatch run in parallel
+    if (props->getProperty("Ice.ThreadPool.Server.Size").empty())
+        props->setProperty("Ice.ThreadPool.Server.Size", "4");
+    if (props->getProperty("Ice.ThreadPool.Client.Size").empty())
+        props->setProperty("Ice.ThreadPool.Client.Size", "4");
+    return data;
+}
+
+static NotifyStats notifyStats(const StopSeq &stops) {
+    NotifyStats total = NotifyStats();
+    for (const auto &stop : stops) {
+        NotifyStats s = stop->getNotifyStats();
+        total.updates += s.updates;
+        total.flushes += s.flushes;
+        total.pushesSent += s.pushesSent;
+        total.pushesSaved += s.pushesSaved;
+        total.pruned += s.pruned;
+    }
+    return total;
+}
+
+// One server process: a stop factory and, in the first one, the registry
+// and the line factory. Commands come one per line: "mpk <proxy>" tells the
+// others the registry, "start" and "stop" enclose the measured window and
+// anything else ends the process. The first server replies with the
+// registry proxy, the others with "ready"; "stop" is answered with the cpu
+// seconds of the window, the resident and peak memory in kB and the
+// notifications dropped in the window.
+static int serve(const Ice::PropertiesPtr &props, int server, FILE *in, FILE *out) {
+    int status = 0;
+    Ice::CommunicatorPtr ic;
+    // the servants log every call
+    cout.rdbuf(nullptr);
+
+    try {
+        ic = Ice::initialize(initData(props));
+        initServants(ic);
+
+        Ice::ObjectAdapterPtr stopAdapter = ic->createObjectAdapterWithEndpoints("BenchStops", "tcp -h 127.0.0.1");
+        StopFactoryPrx stopFactory = StopFactoryPrx::uncheckedCast(
+                stopAdapter->add(new StopFactoryImpl(stopAdapter), Ice::stringToIdentity("StopFactory")));
+        stopAdapter->activate();
+
+        char line[4096];
+        MPKPrx mpk;
+        if (server == 0) {
+            MPKImpl *mpkImpl = new MPKImpl();
+            mpkImpl->setPlacement(props->getPropertyWithDefault("MPK.Placement", "hash"));
+            mpk = MPKPrx::uncheckedCast(stopAdapter->add(mpkImpl, Ice::stringToIdentity("MPK")));
+            Ice::ObjectAdapterPtr lineAdapter = ic->createObjectAdapterWithEndpoints("BenchLines", "tcp -h 127.0.0.1");
+            LineFactoryPrx lineFactory = LineFactoryPrx::uncheckedCast(
+                    lineAdapter->add(new LineFactoryImpl(lineAdapter, mpk), Ice::stringToIdentity("LineFactory")));
+            lineAdapter->activate();
+            mpk->registerLineFactory(lineFactory);
+        } else {
+            if (!fgets(line, sizeof(line), in) || strncmp(line, "mpk ", 4) != 0)
+                throw runtime_error("no registry given");
+            mpk = MPKPrx::uncheckedCast(ic->stringToProxy(string(line + 4, strcspn(line + 4, "\n"))));
+        }
+        mpk->registerStopFactory(stopFactory);
+        fprintf(out, "%s\n", server == 0 ? mpk->ice_toString().c_str() : "ready");
+        fflush(out);
+
+        Usage before = usage();
+        Ice::Long dropped = 0;
+        while (fgets(line, sizeof(line), in)) {
+            string command(line, strcspn(line, "\n"));
+            if (command == "start") {
+                before = usage();
+                dropped = notifier->droppedCount();
+            } else if (command == "stop") {
+                Usage after = usage();
+                fprintf(out, "%f %ld %ld %lld\n", after.cpuSeconds - before.cpuSeconds, currentRssKb(), after.maxRssKb,
+                        static_cast<long long>(notifier->droppedCount() - dropped));
+                fflush(out);
+            } else {
+                break;
+            }
+        }
+    } catch (const Ice::Exception &ex) {
+        cerr << "server " << server << ": " << ex << endl;
+        status = 1;
+    } catch (const exception &ex) {
+        cerr << "server " << server << ": " << ex.what() << endl;
+        status = 1;
+    }
+
+    if (ic) {
+        destroyServants(ic);
+        try {
+            ic->destroy();
+        } catch (const Ice::Exception &) {
+        }
+    }
+    return status;
+}
+
+struct Server {
+    pid_t pid;
+    FILE *in;
+    FILE *out;
+};
+
+// forks server number `server`, before the parent starts any Ice thread
+static Server spawn(const Ice::PropertiesPtr &props, int server, const vector<Server> &running) {
+    int commands[2], replies[2];
+    if (pipe(commands) != 0 || pipe(replies) != 0)
+        throw runtime_error("cant create pipes");
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0)
+        throw runtime_error("cant fork");
+    if (pid == 0) {
+        // only the parent may hold the other servers' pipes, or they never see it exit
+        for (const auto &s : running) {
+            fclose(s.in);
+            fclose(s.out);
+        }
+        close(commands[1]);
+        close(replies[0]);
+        _exit(serve(props, server, fdopen(commands[0], "r"), fdopen(replies[1], "w")));
+    }
+    close(commands[0]);
+    close(replies[1]);
+    return Server{pid, fdopen(commands[1], "w"), fdopen(replies[0], "r")};
+}
+
+static void command(const Server &s, const string &c) {
+    fprintf(s.in, "%s\n", c.c_str());
+    fflush(s.in);
+}
+
+static string reply(const Server &s) {
+    char line[4096];
+    if (!fgets(line, sizeof(line), s.out))
+        throw runtime_error("server " + to_string(s.pid) + " stopped");
+    return string(line, strcspn(line, "\n"));
+}
+
+int main(int argc, char* argv[]) {
+    int status = 0;
+    Ice::CommunicatorPtr ic;
+    vector<Server> servers;
+    streambuf *out = cout.rdbuf();
+
+    try {
+        Ice::PropertiesPtr props = Ice::createProperties(argc, argv);
+        BenchConfig config(props);
+        signal(SIGPIPE, SIG_IGN);
+        for (int k = 0; k < config.servers; k++)
+            servers.push_back(spawn(props, k, servers));
+        string registry = reply(servers[0]);
+        for (size_t k = 1; k < servers.size(); k++) {
+            command(servers[k], "mpk " + registry);
+            reply(servers[k]);
+        }
+
+        ic = Ice::initialize(argc, argv, initData(props));
+        MPKPrx mpk = MPKPrx::uncheckedCast(ic->stringToProxy(registry));
+        cout << config.stops << " stops on " << config.servers << " servers, " << config.lines << " lines of "
+             << config.stopsPerLine << " stops, " << config.trams << " trams, " << config.passengers
+             << " passengers at " << config.stopsPerPassenger << " stops"
+             << (config.batch ? " (subscribed through mpk)" : "") << endl;
+        cout << config.rate << " moves/s, " << config.warmupSeconds << "s warmup + " << config.seconds << "s" << endl;
+
+        // the network is created through the registry, which places the stops
+        NameList names;
+        StopSeq stops;
+        for (int i = 0; i < config.stops; i++) {
+            names.push_back("Stop" + to_string(i));
+            stops.push_back(mpk->createStop(names.back()));
+        }
+
+        // lines share stops when lines * stopsPerLine > stops
+        vector<LinePrx> lines;
+        for (int l = 0; l < config.lines; l++) {
+            int first = static_cast<int>(static_cast<long>(l) * config.stops / config.lines);
+            StopList list;
+            for (int j = 0; j < config.stopsPerLine; j++) {
+                int s = (first + j) % config.stops;
+                list.push_back(StopInfo{timestamp(j), stops[s], names[s]});
+            }
+            lines.push_back(mpk->createLine("L" + to_string(l)));
+            lines.back()->setStops(list);
+        }
+
+        Ice::ObjectAdapterPtr clientAdapter = ic->createObjectAdapterWithEndpoints("BenchClients", "tcp -h 127.0.0.1");
+        clientAdapter->activate();
+        Recorder recorder(nowMs(), config.trams);
+        mt19937 random(config.seed);
+
+        for (int i = 0; i < config.passengers; i++) {
+            PassengerPrx p = PassengerPrx::uncheckedCast(
+                    clientAdapter->add(new BenchPassenger(recorder), Ice::stringToIdentity("Passenger" + to_string(i))));
+            set<int> picked;
+            while (static_cast<int>(picked.size()) < config.stopsPerPassenger)
+                picked.insert(random() % config.stops);
+            if (config.batch) {
+                NameList at;
+                for (int s : picked)
+                    at.push_back(names[s]);
+                mpk->subscribe(p, at, NameList());
+            } else {
+                for (int s : picked)
+                    stops[s]->RegisterPassenger(p);
+            }
+        }
+        cout << "registered " << config.passengers << " passengers" << endl;
+
+        // the trams log every move
+        cout.rdbuf(nullptr);
+        vector<BenchTram*> trams;
+        for (int i = 0; i < config.trams; i++) {
+            BenchTram *tram = new BenchTram(recorder, i);
+            TramPrx proxy = TramPrx::uncheckedCast(clientAdapter->add(tram, Ice::stringToIdentity("Tram" + to_string(i))));
+            tram->setSelfProxy(proxy);
+            tram->setLine(lines[i % config.lines]);
+            lines[i % config.lines]->registerTram(proxy);
+            trams.push_back(tram);
+        }
+        // spread the trams over their lines
+        for (auto *tram : trams) {
+            for (int k = random() % config.stopsPerLine; k >= 0; k--)
+                tram->step();
+        }
+
+        atomic<bool> running{true};
+        vector<thread> drivers;
+        for (int d = 0; d < config.drivers; d++)
+            drivers.emplace_back([&, d] { drive(trams, config, d, running); });
+
+        this_thread::sleep_for(chrono::seconds(config.warmupSeconds));
+        NotifyStats first = notifyStats(stops);
+        for (const auto &s : servers)
+            command(s, "start");
+        Usage before = usage();
+        auto start = chrono::steady_clock::now();
+        recorder.start();
+        this_thread::sleep_for(chrono::seconds(config.seconds));
+        running = false;
+        for (auto &t : drivers)
+            t.join();
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        Usage after = usage();
+
+        double serverCpu = 0;
+        long serverRssKb = 0, serverPeakKb = 0;
+        Ice::Long dropped = 0;
+        for (const auto &s : servers) {
+            command(s, "stop");
+            istringstream result(reply(s));
+            double cpu;
+            long rss, peak;
+            Ice::Long d;
+            result >> cpu >> rss >> peak >> d;
+            serverCpu += cpu;
+            serverRssKb += rss;
+            serverPeakKb += peak;
+            dropped += d;
+        }
+        NotifyStats last = notifyStats(stops);
+
+        // let notifications already sent arrive, they still count
+        this_thread::sleep_for(chrono::milliseconds(max(props->getPropertyAsIntWithDefault("MPK.Stop.CoalesceMs", 100), 0) + 500));
+        recorder.stop();
+        // nothing may call into the recorder once it is gone
+        clientAdapter->deactivate();
+        clientAdapter->waitForDeactivate();
+        cout.rdbuf(out);
+
+        cout << "\nmoves: " << recorder.moveCount() << " (" << recorder.moveCount() / elapsed << "/s)" << endl;
+        cout << "stop updates: " << last.updates - first.updates << ", flushes " << last.flushes - first.flushes
+             << ", pushes sent " << last.pushesSent - first.pushesSent << ", saved " << last.pushesSaved - first.pushesSaved
+             << ", dropped " << dropped << ", pruned " << last.pruned - first.pruned << endl;
+        recorder.report(elapsed);
+        cout << "server cpu: " << serverCpu << " s (" << 100 * serverCpu / elapsed << "% of one core)" << endl;
+        cout << "server memory: " << serverRssKb / 1024 << " MB resident, " << serverPeakKb / 1024
+             << " MB peak (summed over " << servers.size() << " processes)" << endl;
+        double clientCpu = after.cpuSeconds - before.cpuSeconds;
+        cout << "client cpu: " << clientCpu << " s (" << 100 * clientCpu / elapsed << "% of one core)" << endl;
+    } catch (const Ice::Exception &ex) {
+        cout.rdbuf(out);
+        cerr << ex << endl;
+        status = 1;
+    } catch (const exception &ex) {
+        cout.rdbuf(out);
+        cerr << ex.what() << endl;
+        status = 1;
+    }
+
+    if (ic) {
+        try {
+            ic->destroy();
+        } catch (const Ice::Exception &) {
+        }
+    }
+    for (const auto &s : servers) {
+        command(s, "exit");
+        fclose(s.in);
+        fclose(s.out);
+        waitpid(s.pid, nullptr, 0);
+    }
+    return status;
+}
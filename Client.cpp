@@ -1,9 +1,12 @@
 #include <Ice/Ice.h>
+#include <IceUtil/Timer.h>
 #include <SIP.h>
+#include <Timetable.h>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <chrono>
 #include <thread>
 #include <mutex>
@@ -15,7 +18,207 @@ bool running = true;
 mutex mtx;
 map<string, TramPrx> watchedTrams;
 map<string, TramStopPrx> registeredStops;
-map<string, Time> lastUpdatedTime;
+// stops registered at the stop itself (with a line filter or through
+// subscribe) even when a relay is used
+set<string> directStops;
+map<string, Timestamp> lastUpdatedTime;
+
+// the relay delivering our updates, null when registered directly; it and
+// the registrations above are only changed under subsMtx
+mutex subsMtx;
+RelayPrx relay;
+Ice::ConnectionPtr relayConnection;
+
+struct BoardCache {
+    string name;
+    Ice::Long seq = -1;
+    // a getBoard is on its way, deltas are dropped until it is applied
+    bool stale = false;
+    map<string, TramInfo> trams;
+};
+map<string, BoardCache> stopBoards;
+
+// a delta that got here first is only replaced by a newer board
+void applyBoard(BoardCache& board, Ice::Long seq, const TramList& trams) {
+    if (seq <= board.seq)
+        return;
+    board.trams.clear();
+    for (const auto& tram : trams) {
+        board.trams[tram.tram->ice_getIdentity().name] = tram;
+    }
+    board.seq = seq;
+}
+
+void printBoard(const BoardCache& board) {
+    if (board.trams.empty()) {
+        cout << "no trams inc" << endl;
+        return;
+    }
+    TramList trams;
+    for (const auto& kv : board.trams) {
+        trams.push_back(kv.second);
+    }
+    sort(trams.begin(), trams.end(), [](const TramInfo& a, const TramInfo& b) {
+        return a.time.ms < b.time.ms;
+    });
+    cout << "inc trams: " << endl;
+    for (const auto& tram : trams) {
+        cout << "  - Tram " << tram.stockNumber << " arriving at "<< formatClock(tram.time) << endl;
+    }
+}
+
+string watchedStockNumber(const TramPrx& tram) {
+    for (const auto& kv : watchedTrams) {
+        if (kv.second->ice_getIdentity() == tram->ice_getIdentity())
+            return kv.first;
+    }
+    return tram->ice_getIdentity().name;
+}
+
+string boardName(const TramStopPrx& stop) {
+    auto it = stopBoards.find(stop->ice_getIdentity().name);
+    if (it != stopBoards.end() && !it->second.name.empty())
+        return it->second.name;
+    return stop->ice_getIdentity().name;
+}
+
+// fetches the full board of a stop without holding mtx, so the callbacks
+// waiting for mtx never block the reply
+class Resync : public IceUtil::Shared {
+public:
+    void completed(const Ice::AsyncResultPtr& result) {
+        TramStopPrx stop = TramStopPrx::uncheckedCast(result->getProxy());
+        Ice::Long seq = -1;
+        TramList trams;
+        bool ok = true;
+        try {
+            trams = stop->end_getBoard(seq, result);
+        } catch (const Ice::Exception& ex) {
+            cerr << "cant resync stop: " << ex << endl;
+            ok = false;
+        }
+
+        lock_guard<mutex> lock(mtx);
+        auto it = stopBoards.find(stop->ice_getIdentity().name);
+        if (it == stopBoards.end())
+            return;
+        // on failure the next gap tries again
+        it->second.stale = false;
+        if (!ok)
+            return;
+        applyBoard(it->second, seq, trams);
+        cout << "\n[NOTIFICATION] update for stop " << boardName(stop) << endl;
+        printBoard(it->second);
+        cout << "Enter command: ";
+        cout.flush();
+    }
+};
+typedef IceUtil::Handle<Resync> ResyncPtr;
+
+// called with mtx held, only starts the call
+void resync(BoardCache& board, const TramStopPrx& stop) {
+    if (board.stale)
+        return;
+    board.stale = true;
+    ResyncPtr cb = new Resync();
+    try {
+        stop->begin_getBoard(Ice::newCallback(cb, &Resync::completed));
+    } catch (const Ice::Exception& ex) {
+        cerr << "cant resync stop: " << ex << endl;
+        board.stale = false;
+    }
+}
+
+// the first relay answering a ping, starting at the one for this client
+RelayPrx pickRelay(const MPKPrx& mpk, int clientNum, const Ice::ObjectAdapterPtr& adapter) {
+    RelayList relays = mpk->getRelays();
+    for (size_t i = 0; i < relays.size(); i++) {
+        RelayPrx r = relays[(clientNum + i) % relays.size()];
+        try {
+            r->ice_ping();
+            relayConnection = r->ice_getConnection();
+            relayConnection->setAdapter(adapter);
+            return r;
+        } catch (const Ice::Exception& ex) {
+            cerr << "relay " << r->ice_toString() << " unreachable: " << ex << endl;
+        }
+    }
+    relayConnection = 0;
+    return 0;
+}
+
+// Relays keep subscriptions in memory only. The relay is pinged every
+// MPK.Client.RelayCheckMs; when it is gone or answers on a new connection
+// (it restarted) everything it delivered is subscribed again, at another
+// relay or directly at the stops and trams when none is left.
+class RelayCheck : public IceUtil::TimerTask {
+    MPKPrx mpk;
+    PassengerPrx passenger;
+    Ice::ObjectAdapterPtr adapter;
+    int clientNum;
+
+public:
+    RelayCheck(const MPKPrx& m, const PassengerPrx& p, const Ice::ObjectAdapterPtr& a, int n)
+            : mpk(m), passenger(p), adapter(a), clientNum(n) {}
+
+    virtual void runTimerTask() override {
+        lock_guard<mutex> lock(subsMtx);
+        if (!relay || !running)
+            return;
+        try {
+            relay->ice_ping();
+            Ice::ConnectionPtr con = relay->ice_getConnection();
+            if (con == relayConnection)
+                return;
+            cout << "\nrelay reconnected, subscribing again" << endl;
+            con->setAdapter(adapter);
+            relayConnection = con;
+        } catch (const Ice::Exception& ex) {
+            cerr << "\nrelay unreachable: " << ex << endl;
+            try {
+                relay = pickRelay(mpk, clientNum, adapter);
+            } catch (const Ice::Exception& e) {
+                cerr << "cant get relays: " << e << endl;
+                relay = 0;
+            }
+            if (relay)
+                cout << "using relay " << relay->ice_toString() << endl;
+            else
+                cout << "no relay left, registering directly" << endl;
+        }
+        resubscribe();
+    }
+
+private:
+    void resubscribe() {
+        for (const auto& stop : registeredStops) {
+            if (directStops.count(stop.first))
+                continue;
+            try {
+                if (relay) {
+                    relay->subscribeStop(stop.first, passenger);
+                } else {
+                    stop.second->ice_getConnection()->setAdapter(adapter);
+                    stop.second->RegisterPassenger(passenger);
+                }
+            } catch (const Ice::Exception& ex) {
+                cerr << "cant subscribe again to stop " << stop.first << ": " << ex << endl;
+            }
+        }
+        for (const auto& tram : watchedTrams) {
+            try {
+                if (relay) {
+                    relay->subscribeTram(tram.first, passenger);
+                } else {
+                    tram.second->ice_getConnection()->setAdapter(adapter);
+                    tram.second->RegisterPassenger(passenger);
+                }
+            } catch (const Ice::Exception& ex) {
+                cerr << "cant subscribe again to tram " << tram.first << ": " << ex << endl;
+            }
+        }
+    }
+};
 
 class PassengerImpl : public Passenger {
 public:
@@ -24,25 +227,18 @@ public:
     virtual void updateTramInfo(const TramPrx& tram, const StopList& stops, const Ice::Current& = Ice::Current()) override {
         lock_guard<mutex> lock(mtx);
 
-        string stockNumber = tram->getStockNumber();
-        Time currentTime;
-
-        auto now = chrono::system_clock::now();
-        time_t currentTimeT = chrono::system_clock::to_time_t(now);
-        tm* timeinfo = localtime(&currentTimeT);
-        currentTime.hour = timeinfo->tm_hour;
-        currentTime.minute = timeinfo->tm_min;
-
+        string stockNumber = watchedStockNumber(tram);
+        Timestamp currentTime = timestamp(nowMs());
         lastUpdatedTime[stockNumber] = currentTime;
 
-        cout << "\n[NOTIFICATION] update for tram " << stockNumber << " at "<< currentTime.hour << ":" << currentTime.minute << endl;
+        cout << "\n[NOTIFICATION] update for tram " << stockNumber << " at "<< formatClock(currentTime) << endl;
 
         if (stops.empty()) {
             cout << "no upcoming stops" << endl;
         } else {
             cout << "upcoming stops" << endl;
             for (const auto& stop : stops) {
-                cout << "  - " << stop.stop->getName() << " at "<< stop.time.hour << ":"  << stop.time.minute << endl;
+                cout << "  - " << stop.name << " at "<< formatClock(stop.time) << endl;
             }
         }
         cout << "Enter command: ";
@@ -52,29 +248,60 @@ public:
     virtual void updateStopInfo(const TramStopPrx& stop, const TramList& trams, const Ice::Current& = Ice::Current()) override {
         lock_guard<mutex> lock(mtx);
 
-        Time currentTime;
-        auto now = chrono::system_clock::now();
-        time_t currentTimeT = chrono::system_clock::to_time_t(now);
-        tm* timeinfo = localtime(&currentTimeT);
-        currentTime.hour = timeinfo->tm_hour;
-        currentTime.minute = timeinfo->tm_min;
-
-        cout << "\n[NOTIFICATION] update for stop " << stop->getName() << " at "<< currentTime.hour << ":" << currentTime.minute << endl;
+        cout << "\n[NOTIFICATION] update for stop " << boardName(stop) << " at "<< formatClock(timestamp(nowMs())) << endl;
 
         if (trams.empty()) {
             cout << "no trams inc" << endl;
         } else {
             cout << "inc trams: " << endl;
             for (const auto& tram : trams) {
-                cout << "  - Tram " << tram.tram->getStockNumber() << " arriving at "<< tram.time.hour << ":"  << tram.time.minute << endl;
+                cout << "  - Tram " << tram.stockNumber << " arriving at "<< formatClock(tram.time) << endl;
             }
         }
         cout << "Enter command: ";
         cout.flush();
     }
+
+    virtual void updateStopDelta(const TramStopPrx& stop, Ice::Long seq, const TramList& upserts, const TramSeq& removals, const Ice::Current& = Ice::Current()) override {
+        lock_guard<mutex> lock(mtx);
+        applyDelta(stop, seq, upserts, removals);
+        cout << "Enter command: ";
+        cout.flush();
+    }
+
+    virtual void updateStopInfoBatch(const StopBoardList& boards, const Ice::Current& = Ice::Current()) override {
+        lock_guard<mutex> lock(mtx);
+        for (const auto& b : boards) {
+            applyDelta(b.stop, b.seq, b.upserts, b.removals);
+        }
+        cout << "Enter command: ";
+        cout.flush();
+    }
 private:
     string clientId;
 
+    void applyDelta(const TramStopPrx& stop, Ice::Long seq, const TramList& upserts, const TramSeq& removals) {
+        BoardCache& board = stopBoards[stop->ice_getIdentity().name];
+        if (seq <= board.seq || board.stale) {
+            return;
+        }
+
+        if (board.seq < 0 || seq > board.seq + 1) {
+            // missed a delta, start over from the full board
+            resync(board, stop);
+            return;
+        }
+        for (const auto& tram : upserts) {
+            board.trams[tram.tram->ice_getIdentity().name] = tram;
+        }
+        for (const auto& tram : removals) {
+            board.trams.erase(tram->ice_getIdentity().name);
+        }
+        board.seq = seq;
+
+        cout << "\n[NOTIFICATION] update for stop " << boardName(stop) << endl;
+        printBoard(board);
+    }
 };
 
 
@@ -101,17 +328,26 @@ int main(int argc, char* argv[]) {
 
     int status = 0;
     Ice::CommunicatorPtr ic;
+    IceUtil::TimerPtr relayTimer;
 
     try {
-        ic = Ice::initialize(argc, argv);
-
-        // Create unique port for this client
-        stringstream endpoint;
-        int port = 10000 + clientNum;
-        endpoint << "default -p " << port;
-
-        Ice::ObjectAdapterPtr adapter = ic->createObjectAdapterWithEndpoints(
-                "ClientAdapter", endpoint.str());
+        Ice::InitializationData initData;
+        initData.properties = Ice::createProperties(argc, argv);
+        // the servers call back over our connections, keep them open while idle
+        if (initData.properties->getProperty("Ice.ACM.Client.Heartbeat").empty())
+            initData.properties->setProperty("Ice.ACM.Client.Heartbeat", "3");
+        ic = Ice::initialize(argc, argv, initData);
+
+        // no endpoints: stops and trams call back over the connection the
+        // passenger registered on; subscribe goes through MPK only with
+        // MPK.Client.Endpoints, without it the stops are registered one by one
+        string endpoints = initData.properties->getProperty("MPK.Client.Endpoints");
+        Ice::ObjectAdapterPtr adapter = endpoints.empty()
+                ? ic->createObjectAdapter("")
+                : ic->createObjectAdapterWithEndpoints("PassengerAdapter", endpoints);
+        auto attach = [&adapter](const Ice::ObjectPrx &proxy) {
+            proxy->ice_getConnection()->setAdapter(adapter);
+        };
 
         Ice::ObjectPtr passenger = new PassengerImpl(clientId);
         string passengerIdentity = "Passenger" + clientId;
@@ -136,8 +372,50 @@ int main(int argc, char* argv[]) {
             return 1;
         }
 
+        // with relays running, one of them delivers the updates instead of
+        // the stops and trams themselves
+        try {
+            relay = pickRelay(mpk, clientNum, adapter);
+            if (relay) {
+                cout << "using relay " << relay->ice_toString() << endl;
+                int checkMs = initData.properties->getPropertyAsIntWithDefault("MPK.Client.RelayCheckMs", 5000);
+                if (checkMs > 0) {
+                    relayTimer = new IceUtil::Timer();
+                    relayTimer->scheduleRepeated(new RelayCheck(mpk, passengerPrx, adapter, clientNum),
+                                                 IceUtil::Time::milliSeconds(checkMs));
+                }
+            }
+        } catch (const Ice::Exception& ex) {
+            cerr << "cant get relays, subscribing directly" << endl;
+        }
+
+        // unfiltered registration, through the relay when there is one
+        auto registerStop = [&](const string& name, const TramStopPrx& stop) {
+            if (relay) {
+                relay->subscribeStop(name, passengerPrx);
+            } else {
+                attach(stop);
+                stop->RegisterPassenger(passengerPrx);
+            }
+            registeredStops[name] = stop;
+        };
+        // the board is fetched before taking mtx, callbacks keep running meanwhile
+        auto showBoard = [](const string& name, const TramStopPrx& stop) {
+            Ice::Long seq = -1;
+            TramList trams = stop->getBoard(seq);
+            lock_guard<mutex> lock(mtx);
+            BoardCache& board = stopBoards[stop->ice_getIdentity().name];
+            board.name = name;
+            applyBoard(board, seq, trams);
+            printBoard(board);
+        };
+
         cout << "commands:" << endl;
         cout << "  register stop <name>   - register at stop for updates" << endl;
+        cout << "  register stop <name> [line...] [max=N] [horizon=MIN] [change=SEC]" << endl;
+        cout << "                         - only trams of these lines, at most N of them," << endl;
+        cout << "                           arriving within MIN minutes, updates once one moved SEC seconds" << endl;
+        cout << "  subscribe <name>...    - register at many stops in one call" << endl;
         cout << "  unregister stop <name> - unregister from a stop" << endl;
         cout << "  watch tram <number>    - register on a tram for updates" << endl;
         cout << "  unwatch tram <number>  - unregister from a tram" << endl;
@@ -151,6 +429,7 @@ int main(int argc, char* argv[]) {
             istringstream iss(command);
             string cmd, subcmd, name;
             iss >> cmd;
+            unique_lock<mutex> subsLock(subsMtx);
 
             try {
                 if (cmd == "exit") {
@@ -159,7 +438,10 @@ int main(int argc, char* argv[]) {
 
                     for (const auto& stop : registeredStops) {
                         try {
-                            stop.second->UnregisterPassenger(passengerPrx);
+                            if (relay && !directStops.count(stop.first))
+                                relay->unsubscribeStop(stop.first, passengerPrx);
+                            else
+                                stop.second->UnregisterPassenger(passengerPrx);
                             cout << "Unregistered from stop: " << stop.first << endl;
                         }
                         catch (...) {
@@ -168,7 +450,10 @@ int main(int argc, char* argv[]) {
 
                     for (const auto& tram : watchedTrams) {
                         try {
-                            tram.second->UnregisterPassenger(passengerPrx);
+                            if (relay)
+                                relay->unsubscribeTram(tram.first, passengerPrx);
+                            else
+                                tram.second->UnregisterPassenger(passengerPrx);
                             cout << "Unregistered from tram: " << tram.first << endl;
                         }
                         catch (...) {
@@ -185,22 +470,36 @@ int main(int argc, char* argv[]) {
                                 continue;
                             }
 
-                            TramStopPrx stop = mpk->getTramStop(name);
-                            stop->RegisterPassenger(passengerPrx);
-                            registeredStops[name] = stop;
-
-                            cout << "registered at stop"<< endl;
+                            SubscriptionFilter filter = SubscriptionFilter();
+                            string arg;
+                            while (iss >> arg) {
+                                if (arg.compare(0, 4, "max=") == 0)
+                                    filter.maxTrams = stoi(arg.substr(4));
+                                else if (arg.compare(0, 8, "horizon=") == 0)
+                                    filter.horizonMs = stol(arg.substr(8)) * 60 * 1000;
+                                else if (arg.compare(0, 7, "change=") == 0)
+                                    filter.minChangeMs = stol(arg.substr(7)) * 1000;
+                                else
+                                    filter.lines.push_back(arg);
+                            }
+                            bool filtered = !filter.lines.empty() || filter.maxTrams > 0
+                                            || filter.horizonMs > 0 || filter.minChangeMs > 0;
 
-                            TramList trams = stop->getNextTrams(5);
-                            if (trams.empty()) {
-                                cout << "no incoming trams" << endl;
-                            } else {
-                                cout << "incoming trams:" << endl;
-                                for (const auto& tram : trams) {
-                                    cout << "- Tram " << tram.tram->getStockNumber() << " arriving at "
-                                         << tram.time.hour << ":" << tram.time.minute << endl;
-                                }
+                            TramStopPrx stop = mpk->getTramStop(name);
+                            if (filtered) {
+                                // the stop filters, relays only forward everything
+                                attach(stop);
+                                stop->RegisterPassengerFiltered(passengerPrx, filter);
+                                registeredStops[name] = stop;
+                                directStops.insert(name);
+                                lock_guard<mutex> lock(mtx);
+                                stopBoards[stop->ice_getIdentity().name].name = name;
+                                cout << "registered at stop with a filter" << endl;
+                                continue;
                             }
+                            registerStop(name, stop);
+                            cout << "registered at stop"<< endl;
+                            showBoard(name, stop);
                         }
                         catch (const exception& ex) {
                             cout << "register error : " <<endl;
@@ -209,13 +508,62 @@ int main(int argc, char* argv[]) {
                         cout << "provide stop name!" << endl;
                     }
                 }
+                else if (cmd == "subscribe") {
+                    NameList names;
+                    while (iss >> name) {
+                        if (registeredStops.find(name) == registeredStops.end())
+                            names.push_back(name);
+                    }
+                    if (names.empty()) {
+                        cout << "provide stop names!" << endl;
+                    } else if (endpoints.empty()) {
+                        // MPK cant call back a passenger without endpoints,
+                        // register at the stops one by one instead
+                        for (const auto& n : names) {
+                            try {
+                                TramStopPrx stop = mpk->getTramStop(n);
+                                registerStop(n, stop);
+                                showBoard(n, stop);
+                            }
+                            catch (const exception& ex) {
+                                cout << "subscribe error at " << n << " : " << ex.what() << endl;
+                            }
+                        }
+                    } else {
+                        try {
+                            // the boards come back with the call
+                            StopBoardList boards = mpk->subscribe(passengerPrx, names, NameList());
+                            cout << "registered at " << names.size() << " stops" << endl;
+
+                            lock_guard<mutex> lock(mtx);
+                            for (size_t i = 0; i < boards.size() && i < names.size(); i++) {
+                                const StopBoard& b = boards[i];
+                                registeredStops[names[i]] = b.stop;
+                                directStops.insert(names[i]);
+                                BoardCache& board = stopBoards[b.stop->ice_getIdentity().name];
+                                board.name = names[i];
+                                applyBoard(board, b.seq, b.upserts);
+                                printBoard(board);
+                            }
+                        }
+                        catch (const exception& ex) {
+                            cout << "subscribe error : " << ex.what() << endl;
+                        }
+                    }
+                }
                 else if (cmd == "unregister") {
                     iss >> subcmd >> name;
                     if (subcmd == "stop" && !name.empty()) {
                         try {
                             auto it = registeredStops.find(name);
                             if (it != registeredStops.end()) {
-                                it->second->UnregisterPassenger(passengerPrx);
+                                if (relay && !directStops.count(name))
+                                    relay->unsubscribeStop(name, passengerPrx);
+                                else
+                                    it->second->UnregisterPassenger(passengerPrx);
+                                directStops.erase(name);
+                                lock_guard<mutex> lock(mtx);
+                                stopBoards.erase(it->second->ice_getIdentity().name);
                                 registeredStops.erase(it);
                                 cout << "unregistered from stop " << endl;
                             } else {
@@ -239,29 +587,20 @@ int main(int argc, char* argv[]) {
                                 continue;
                             }
 
-                            bool found = false;
-                            LineList lines = mpk->getLines();
-
-                            for (const auto& line : lines) {
-                                TramList trams = line->getTrams();
-                                for (const auto& tram : trams) {
-                                    if (tram.tram->getStockNumber() == name) {
-                                        tram.tram->RegisterPassenger(passengerPrx);
-                                        watchedTrams[name] = tram.tram;
-                                        found = true;
-
-                                        cout << "registered on tram " << name << endl;
-
-
-                                        break;
-                                    }
-                                }
-                                if (found) break;
+                            TramPrx tram = mpk->findTram(name);
+                            if (!tram) {
+                                cout << "tram not found" << endl;
+                                continue;
                             }
 
-                            if (!found) {
-                                cout << "tram not found" << endl;
+                            if (relay) {
+                                relay->subscribeTram(name, passengerPrx);
+                            } else {
+                                attach(tram);
+                                tram->RegisterPassenger(passengerPrx);
                             }
+                            watchedTrams[name] = tram;
+                            cout << "registered on tram " << name << endl;
                         }
                         catch (const exception& ex) {
                             cout << "Error registering on tram" << endl;
@@ -276,7 +615,10 @@ int main(int argc, char* argv[]) {
                         try {
                             auto it = watchedTrams.find(name);
                             if (it != watchedTrams.end()) {
-                                it->second->UnregisterPassenger(passengerPrx);
+                                if (relay)
+                                    relay->unsubscribeTram(name, passengerPrx);
+                                else
+                                    it->second->UnregisterPassenger(passengerPrx);
                                 watchedTrams.erase(it);
                                 cout << "unregistered from tram "  << endl;
                             }
@@ -298,6 +640,9 @@ int main(int argc, char* argv[]) {
             }
         }
 
+        if (relayTimer) {
+            relayTimer->destroy();
+        }
         if (ic) {
             ic->destroy();
         }
@@ -305,6 +650,8 @@ int main(int argc, char* argv[]) {
     catch (const exception& ex) {
         cerr << "Error: " << ex.what() << endl;
         status = 1;
+        if (relayTimer)
+            relayTimer->destroy();
     }
 
     return status;
@@ -0,0 +1,129 @@
+#include <Ice/Ice.h>
+#include <SIP.h>
+#include <Servants.h>
+#include <iostream>
+
+using namespace std;
+using namespace SIP;
+
+// Standalone process hosting line and stop servants. It registers its
+// factories with MPK, which places new lines and stops on the factory owning
+// their name on the hash ring, or with MPK.Placement=load on whichever
+// factory reports the lowest load.
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <base_port>" << endl;
+        return 1;
+    }
+
+    int basePort;
+    try {
+        basePort = stoi(argv[1]);
+    } catch (const exception &ex) {
+        cerr << "invalid port: " << ex.what() << endl;
+        return 2;
+    }
+
+    int status = 0;
+    Ice::CommunicatorPtr ic;
+    StorePtr store;
+
+    try {
+        ic = Ice::initialize(argc, argv);
+        initServants(ic);
+
+        // persistence is off unless MPK.Store.Dir is set
+        try {
+            store = openStore(ic, ic->getProperties()->getProperty("MPK.Store.Dir"));
+        } catch (const exception &ex) {
+            cerr << "cant open store, running without persistence: " << ex.what() << endl;
+        }
+
+        // factories on the base port, lines and stops on the next two
+        Ice::ObjectAdapterPtr factoryAdapter = ic->createObjectAdapterWithEndpoints(
+                "FactoryAdapter", "default -p " + to_string(basePort));
+        Ice::ObjectAdapterPtr lineAdapter = ic->createObjectAdapterWithEndpoints(
+                "LineAdapter", "default -p " + to_string(basePort + 1));
+        Ice::ObjectAdapterPtr stopAdapter = ic->createObjectAdapterWithEndpoints(
+                "StopAdapter", "default -p " + to_string(basePort + 2));
+        factoryAdapter->activate();
+        lineAdapter->activate();
+        stopAdapter->activate();
+
+        MPKPrx mpk = MPKPrx::uncheckedCast(ic->stringToProxy("MPK:default -p 10000"));
+
+        LineFactoryPrx lineFactory = LineFactoryPrx::uncheckedCast(
+                factoryAdapter->add(new LineFactoryImpl(lineAdapter, mpk, store), Ice::stringToIdentity("LineFactory")));
+        StopFactoryPrx stopFactory = StopFactoryPrx::uncheckedCast(
+                factoryAdapter->add(new StopFactoryImpl(stopAdapter, store), Ice::stringToIdentity("StopFactory")));
+
+        try {
+            mpk->registerLineFactory(lineFactory);
+            mpk->registerStopFactory(stopFactory);
+            cout << "factories registered at mpk" << endl;
+        } catch (const Ice::Exception &ex) {
+            cerr << "cant register at mpk: " << ex << endl;
+            destroyServants(ic);
+            if (store)
+                store->close();
+            ic->destroy();
+            return 3;
+        }
+
+        cout << "commands:" << endl;
+        cout << "  load - show number of lines and stops and cache stats" << endl;
+        cout << "  exit - exit" << endl;
+
+        bool running = true;
+        string command;
+        while (running) {
+            cout << "\nenter command: ";
+            if (!getline(cin, command))
+                break;
+
+            istringstream iss(command);
+            string cmd;
+            iss >> cmd;
+
+            if (cmd == "exit") {
+                running = false;
+                cout << "closing..." << endl;
+            } else if (cmd == "load") {
+                CacheStats lineStats = lineFactory->getCacheStats();
+                CacheStats stopStats = stopFactory->getCacheStats();
+                cout << "lines: " << lineFactory->getLoad() << " (resident " << lineStats.resident
+                     << ", hits " << lineStats.hits << ", misses " << lineStats.misses << ", evictions " << lineStats.evictions << ")" << endl;
+                cout << "stops: " << stopFactory->getLoad() << " (resident " << stopStats.resident
+                     << ", hits " << stopStats.hits << ", misses " << stopStats.misses << ", evictions " << stopStats.evictions << ")" << endl;
+            } else {
+                cout << "unknown command" << endl;
+            }
+        }
+
+        try {
+            mpk->unregisterLineFactory(lineFactory);
+            mpk->unregisterStopFactory(stopFactory);
+        } catch (const Ice::Exception &ex) {
+            cerr << "cant unregister from mpk: " << ex << endl;
+        }
+
+        destroyServants(ic);
+        if (store)
+            store->close();
+        ic->destroy();
+    } catch (const Ice::Exception &ex) {
+        cerr << ex << endl;
+        destroyServants(ic);
+        if (store)
+            store->close();
+        if (ic) {
+            try {
+                ic->destroy();
+            } catch (const Ice::Exception &) {
+            }
+        }
+        status = 1;
+    }
+
+    return status;
+}
@@ -0,0 +1,1001 @@
+#ifndef MPK_H
+#define MPK_H
+
+#include <Ice/Ice.h>
+#include <SIP.h>
+#include <Servants.h>
+#include <Network.h>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <set>
+#include <unordered_map>
+#include <exception>
+#include <IceUtil/UUID.h>
+
+// Registry servants, shared by the system process and the benchmark.
+
+using namespace SIP;
+
+
+
+// Consistent hash ring over factory nodes. Each node owns `replicas` points
+// on the ring and a name belongs to the first point at or after its hash,
+// so a node joining or leaving only moves the names next to its own points.
+// The ring only places new names; names are not resolved through it, a
+// stop is looked up where it was created (MPKImpl::tramStops) so a factory
+// joining later does not move it. A point already taken by another node is
+// moved to the next free position, and each node remembers its own points
+// so removing it never takes away another node's.
+class HashRing {
+public:
+    struct Node {
+        Ice::ObjectPrx factory;
+        std::vector<uint32_t> points;
+    };
+
+private:
+    static const int replicas = 128;
+    std::map<uint32_t, std::string> points;
+    std::map<std::string, Node> nodes;
+
+    // FNV-1a, stable across processes and runs
+    static uint32_t hash(const std::string &key) {
+        uint32_t h = 2166136261u;
+        for (unsigned char c : key) {
+            h ^= c;
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+public:
+    void add(const Ice::ObjectPrx &factory) {
+        std::string key = factory->ice_toString();
+        if (nodes.count(key))
+            remove(factory);
+        Node &node = nodes[key];
+        node.factory = factory;
+        for (int i = 0; i < replicas; i++) {
+            uint32_t point = hash(key + "#" + std::to_string(i));
+            while (points.count(point))
+                point++;
+            points[point] = key;
+            node.points.push_back(point);
+        }
+    }
+
+    void remove(const Ice::ObjectPrx &factory) {
+        auto it = nodes.find(factory->ice_toString());
+        if (it == nodes.end())
+            return;
+        for (uint32_t point : it->second.points) {
+            auto p = points.find(point);
+            if (p != points.end() && p->second == it->first)
+                points.erase(p);
+        }
+        nodes.erase(it);
+    }
+
+    const Node *owner(const std::string &name) const {
+        if (points.empty())
+            return nullptr;
+        auto it = points.lower_bound(hash(name));
+        if (it == points.end())
+            it = points.begin();
+        return &nodes.at(it->second);
+    }
+
+    bool empty() const {
+        return points.empty();
+    }
+};
+
+// MPK state is published as immutable snapshots: readers load the current
+// pointer without locking, writers copy it under writeMtx, apply their
+// change and publish the new version. Writes are rare compared to lookups.
+struct MPKCatalog {
+    std::map<std::string, DepoPrx> depos;
+    std::vector<LinePrx> lines;
+    std::vector<LineFactoryPrx> lineFactories;
+    std::vector<StopFactoryPrx> stopFactories;
+    std::vector<RelayPrx> relays;
+    HashRing lineRing;
+    HashRing stopRing;
+};
+
+// Trams register and unregister far more often than the network changes,
+// so the directory is not copied on write like the catalog but changed in
+// place under a reader/writer lock. byIdentity finds the stock number a
+// tram was registered under without a scan, lines the line it runs on so a
+// tram found dead can be taken off it.
+struct TramDirectory {
+    std::map<std::string, TramPrx> trams;
+    std::map<std::string, std::string> lines;
+    std::map<Ice::Identity, std::string> byIdentity;
+
+    // an empty line keeps the one the tram was registered with before
+    void add(const std::string &stockNumber, const TramPrx &tram, const std::string &line = std::string()) {
+        Ice::Identity id = tram->ice_getIdentity();
+        auto previous = byIdentity.find(id);
+        if (previous != byIdentity.end() && previous->second != stockNumber) {
+            trams.erase(previous->second);
+            lines.erase(previous->second);
+        }
+        auto replaced = trams.find(stockNumber);
+        if (replaced != trams.end() && replaced->second->ice_getIdentity() != id) {
+            byIdentity.erase(replaced->second->ice_getIdentity());
+            lines.erase(stockNumber);
+        }
+        trams[stockNumber] = tram;
+        byIdentity[id] = stockNumber;
+        if (!line.empty())
+            lines[stockNumber] = line;
+    }
+
+    std::string lineOf(const std::string &stockNumber) const {
+        auto it = lines.find(stockNumber);
+        return it != lines.end() ? it->second : std::string();
+    }
+
+    // the stock number tram was registered under, empty if it was not
+    std::string remove(const TramPrx &tram) {
+        auto it = byIdentity.find(tram->ice_getIdentity());
+        if (it == byIdentity.end())
+            return std::string();
+        std::string stockNumber = it->second;
+        trams.erase(stockNumber);
+        lines.erase(stockNumber);
+        byIdentity.erase(it);
+        return stockNumber;
+    }
+};
+
+class LineIteratorImpl : public LineIterator {
+public:
+    typedef std::function<void(const Ice::Identity&)> DestroyHandler;
+
+private:
+    // page size used when next() is asked for no lines
+    static const int defaultPage = 100;
+
+    std::shared_ptr<const MPKCatalog> snapshot;
+    size_t position = 0;
+    std::mutex mtx;
+    DestroyHandler onDestroy;
+public:
+    LineIteratorImpl(const std::shared_ptr<const MPKCatalog> &s, const DestroyHandler &d) : snapshot(s), onDestroy(d) {}
+
+    virtual LineList next(int max, bool &more, const Ice::Current &current = Ice::Current()) override {
+        LineList result;
+        if (max <= 0)
+            max = defaultPage;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            const LineList &lines = snapshot->lines;
+            size_t end = std::min(position + static_cast<size_t>(max), lines.size());
+            result.assign(lines.begin() + position, lines.begin() + end);
+            position = end;
+            more = position < lines.size();
+        }
+        if (!more)
+            destroy(current);
+        return result;
+    }
+
+    virtual void destroy(const Ice::Current &current = Ice::Current()) override {
+        if (!current.adapter)
+            return;
+        try {
+            current.adapter->remove(current.id);
+        } catch (const Ice::NotRegisteredException &) {
+        }
+        if (onDestroy)
+            onDestroy(current.id);
+    }
+};
+
+class MPKImpl : public MPK {
+    std::shared_ptr<const MPKCatalog> catalog = std::make_shared<MPKCatalog>();
+    TramDirectory directory;
+    mutable std::shared_timed_mutex directoryMtx;
+
+    // every stop by the name it was created under; with 100k+ stops it is
+    // changed in place under its own lock rather than copied with the catalog
+    std::unordered_map<std::string, TramStopPrx> tramStops;
+    mutable std::shared_timed_mutex stopsMtx;
+    std::mutex writeMtx;
+
+    // names being created right now: a second create of the same name waits
+    // for the first one and returns its result instead of placing it again
+    std::mutex creatingMtx;
+    std::condition_variable creatingCv;
+    std::set<std::string> creating;
+
+    class Reservation {
+        MPKImpl &mpk;
+        std::string key;
+    public:
+        Reservation(MPKImpl &mpk, const std::string &key) : mpk(mpk), key(key) {
+            std::unique_lock<std::mutex> lock(mpk.creatingMtx);
+            mpk.creatingCv.wait(lock, [&] { return !mpk.creating.count(key); });
+            mpk.creating.insert(key);
+        }
+        ~Reservation() {
+            {
+                std::lock_guard<std::mutex> lock(mpk.creatingMtx);
+                mpk.creating.erase(key);
+            }
+            mpk.creatingCv.notify_all();
+        }
+    };
+
+    // iterators a client never finished are dropped oldest first
+    static const size_t maxIterators = 1000;
+    std::deque<Ice::Identity> iterators;
+    std::mutex iteratorsMtx;
+
+    // factory loads by stringified proxy, refreshed by refreshLoads() and
+    // bumped locally on every placement so bursts spread between refreshes
+    std::map<std::string, double> loads;
+    std::mutex loadsMtx;
+
+    // placement policy: "hash" (MPK.Placement, the default) puts a name on
+    // the factory owning it on the ring, "load" on the least loaded one
+    bool hashPlacement = true;
+
+    // consecutive failed liveness checks by "lf:", "sf:", "relay:" or "tram:" key
+    std::map<std::string, int> misses;
+    std::mutex missesMtx;
+    int livenessTimeoutMs = 2000;
+    int livenessMaxFailures = 3;
+
+    // every catalog change is also written to the store under writeMtx and
+    // every directory change under directoryMtx, recover() rebuilds both
+    StorePtr store;
+
+    template<class... T>
+    void persist(const std::string &key, const T&... values) {
+        if (store)
+            store->write("mpk/" + key, values...);
+    }
+
+    void forget(const std::string &key) {
+        if (store)
+            store->erase("mpk/" + key);
+    }
+
+    template<class Factory>
+    static Factory ringOwner(const HashRing &ring, const std::string &name) {
+        const HashRing::Node *node = ring.owner(name);
+        return node ? Factory::uncheckedCast(node->factory) : Factory();
+    }
+
+    template<class Factory>
+    Factory leastLoaded(const std::vector<Factory> &factories) {
+        std::lock_guard<std::mutex> lock(loadsMtx);
+        Factory best;
+        double bestLoad = 0;
+        for (const auto &f : factories) {
+            auto it = loads.find(f->ice_toString());
+            double load = it != loads.end() ? it->second : 0;
+            if (!best || load < bestLoad) {
+                best = f;
+                bestLoad = load;
+            }
+        }
+        if (best)
+            loads[best->ice_toString()] = bestLoad + 1;
+        return best;
+    }
+
+    std::shared_ptr<const MPKCatalog> readCatalog() const {
+        return std::atomic_load(&catalog);
+    }
+
+    template<class Change>
+    void updateCatalog(Change change) {
+        std::lock_guard<std::mutex> lock(writeMtx);
+        auto next = std::make_shared<MPKCatalog>(*catalog);
+        change(*next);
+        std::atomic_store(&catalog, std::shared_ptr<const MPKCatalog>(next));
+    }
+
+
+public:
+    virtual TramStopPrx getTramStop(const std::string& name, const Ice::Current& = Ice::Current()) override {
+        std::shared_lock<std::shared_timed_mutex> lock(stopsMtx);
+        auto it = tramStops.find(name);
+        if (it != tramStops.end())
+            return it->second;
+        throw std::runtime_error("Tram stop not found");
+    }
+
+    virtual void registerDepo(const DepoPrx& depo, const Ice::Current& = Ice::Current()) override {
+        std::string name = depo->getName();
+        updateCatalog([&](MPKCatalog &c) {
+            c.depos[name] = depo;
+            persist("depo/" + name, depo);
+        });
+    }
+
+    virtual void unregisterDepo(const DepoPrx& depo, const Ice::Current& = Ice::Current()) override {
+        std::string name = depo->getName();
+        updateCatalog([&](MPKCatalog &c) {
+            c.depos.erase(name);
+            forget("depo/" + name);
+        });
+    }
+
+    virtual DepoPrx getDepo(const std::string& name, const Ice::Current& = Ice::Current()) override {
+        return readCatalog()->depos.at(name);
+    }
+
+    virtual DepoList getDepos(const Ice::Current& = Ice::Current()) override {
+        auto snapshot = readCatalog();
+        DepoList list;
+        for (auto& kv : snapshot->depos) {
+            DepoInfo info;
+            info.name = kv.first;
+            info.stop = kv.second;
+            list.push_back(info);
+        }
+        return list;
+    }
+
+    virtual LineList getLines(const Ice::Current& = Ice::Current()) override {
+        return readCatalog()->lines;
+    }
+
+    virtual LineList getLinesRange(int offset, int limit, int &total, const Ice::Current& = Ice::Current()) override {
+        return sliceRange(readCatalog()->lines, offset, limit, total);
+    }
+
+    virtual DepoList getDeposRange(int offset, int limit, int &total, const Ice::Current& = Ice::Current()) override {
+        auto snapshot = readCatalog();
+        total = static_cast<int>(snapshot->depos.size());
+
+        DepoList list;
+        auto it = snapshot->depos.begin();
+        std::advance(it, std::min(static_cast<size_t>(std::max(offset, 0)), snapshot->depos.size()));
+        for (; it != snapshot->depos.end() && static_cast<int>(list.size()) < limit; ++it) {
+            DepoInfo info;
+            info.name = it->first;
+            info.stop = it->second;
+            list.push_back(info);
+        }
+        return list;
+    }
+
+    virtual LineIteratorPrx iterateLines(const Ice::Current &current = Ice::Current()) override {
+        Ice::Identity id;
+        id.category = "iterator";
+        id.name = IceUtil::generateUUID();
+        Ice::ObjectPtr self = this;
+        LineIteratorPrx iterator = LineIteratorPrx::uncheckedCast(current.adapter->add(
+                new LineIteratorImpl(readCatalog(), [self](const Ice::Identity &finished) {
+                    dynamic_cast<MPKImpl*>(self.get())->forgetIterator(finished);
+                }), id));
+
+        std::lock_guard<std::mutex> lock(iteratorsMtx);
+        iterators.push_back(id);
+        while (iterators.size() > maxIterators) {
+            try {
+                current.adapter->remove(iterators.front());
+            } catch (const Ice::NotRegisteredException &) {
+            }
+            iterators.pop_front();
+        }
+        return iterator;
+    }
+
+    void forgetIterator(const Ice::Identity &id) {
+        std::lock_guard<std::mutex> lock(iteratorsMtx);
+        iterators.erase(remove(iterators.begin(), iterators.end(), id), iterators.end());
+    }
+
+    virtual void registerLineFactory(const LineFactoryPrx &lf, const Ice::Current& = Ice::Current()) override {
+        updateCatalog([&](MPKCatalog &c) {
+            // a factory coming back after a restart may already be known
+            if (std::find(c.lineFactories.begin(), c.lineFactories.end(), lf) == c.lineFactories.end())
+                c.lineFactories.push_back(lf);
+            c.lineRing.add(lf);
+            persist("lf/" + lf->ice_toString(), lf);
+        });
+    }
+
+    virtual void unregisterLineFactory(const LineFactoryPrx &lf, const Ice::Current& = Ice::Current()) override {
+        updateCatalog([&](MPKCatalog &c) {
+            c.lineFactories.erase(remove(c.lineFactories.begin(), c.lineFactories.end(), lf), c.lineFactories.end());
+            c.lineRing.remove(lf);
+            forget("lf/" + lf->ice_toString());
+        });
+    }
+
+    virtual void registerStopFactory(const StopFactoryPrx &sf, const Ice::Current& = Ice::Current()) override {
+        updateCatalog([&](MPKCatalog &c) {
+            if (std::find(c.stopFactories.begin(), c.stopFactories.end(), sf) == c.stopFactories.end())
+                c.stopFactories.push_back(sf);
+            c.stopRing.add(sf);
+            persist("sf/" + sf->ice_toString(), sf);
+        });
+    }
+
+    virtual void unregisterStopFactory(const StopFactoryPrx &sf, const Ice::Current& = Ice::Current()) override {
+        updateCatalog([&](MPKCatalog &c) {
+            c.stopFactories.erase(remove(c.stopFactories.begin(), c.stopFactories.end(), sf), c.stopFactories.end());
+            c.stopRing.remove(sf);
+            forget("sf/" + sf->ice_toString());
+        });
+    }
+
+    virtual void registerTram(const TramInfo &info, const Ice::Current& = Ice::Current()) override {
+        std::unique_lock<std::shared_timed_mutex> lock(directoryMtx);
+        directory.add(info.stockNumber, info.tram, info.line);
+        persist("tram/" + info.stockNumber, info.tram, directory.lineOf(info.stockNumber));
+    }
+
+    virtual void unregisterTram(const TramPrx &tram, const Ice::Current& = Ice::Current()) override {
+        std::unique_lock<std::shared_timed_mutex> lock(directoryMtx);
+        std::string stockNumber = directory.remove(tram);
+        if (!stockNumber.empty())
+            forget("tram/" + stockNumber);
+    }
+
+    virtual TramPrx findTram(const std::string &stockNumber, const Ice::Current& = Ice::Current()) override {
+        std::shared_lock<std::shared_timed_mutex> lock(directoryMtx);
+        auto it = directory.trams.find(stockNumber);
+        return it != directory.trams.end() ? it->second : TramPrx();
+    }
+
+    virtual TramList findTrams(const NameList &stockNumbers, const Ice::Current& = Ice::Current()) override {
+        std::shared_lock<std::shared_timed_mutex> lock(directoryMtx);
+        TramList result;
+        for (const auto &stockNumber : stockNumbers) {
+            auto it = directory.trams.find(stockNumber);
+            if (it == directory.trams.end())
+                continue;
+            TramInfo info;
+            info.time.ms = 0;
+            info.tram = it->second;
+            info.stockNumber = stockNumber;
+            info.line = directory.lineOf(stockNumber);
+            result.push_back(info);
+        }
+        return result;
+    }
+
+    virtual void registerRelay(const RelayPrx &relay, const Ice::Current& = Ice::Current()) override {
+        updateCatalog([&](MPKCatalog &c) {
+            if (std::find(c.relays.begin(), c.relays.end(), relay) == c.relays.end())
+                c.relays.push_back(relay);
+            persist("relay/" + relay->ice_toString(), relay);
+        });
+    }
+
+    virtual void unregisterRelay(const RelayPrx &relay, const Ice::Current& = Ice::Current()) override {
+        updateCatalog([&](MPKCatalog &c) {
+            c.relays.erase(remove(c.relays.begin(), c.relays.end(), relay), c.relays.end());
+            forget("relay/" + relay->ice_toString());
+        });
+    }
+
+    virtual RelayList getRelays(const Ice::Current& = Ice::Current()) override {
+        return readCatalog()->relays;
+    }
+
+    // every name is resolved before anything is registered, so an unknown
+    // stop or tram fails the whole call unless skipUnknown is set; stops are
+    // also kept in name order
+    void resolve(const NameList &stopNames, const NameList &stockNumbers, std::map<std::string, StopSeq> &stopsByServer,
+                 TramSeq &trams, StopSeq &stops, bool skipUnknown = false) {
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(stopsMtx);
+            for (const auto &name : stopNames) {
+                auto it = tramStops.find(name);
+                if (it == tramStops.end()) {
+                    if (skipUnknown)
+                        continue;
+                    throw std::runtime_error("Tram stop not found");
+                }
+                stops.push_back(it->second);
+                stopsByServer[serverKey(it->second)].push_back(it->second);
+            }
+        }
+        std::shared_lock<std::shared_timed_mutex> lock(directoryMtx);
+        for (const auto &stockNumber : stockNumbers) {
+            auto it = directory.trams.find(stockNumber);
+            if (it == directory.trams.end()) {
+                if (skipUnknown)
+                    continue;
+                throw std::runtime_error("tram " + stockNumber + " not found");
+            }
+            trams.push_back(it->second);
+        }
+    }
+
+    // One RegisterPassengerBatch per stop server and one RegisterPassenger
+    // per tram, all in flight together, then the boards of all stops in
+    // parallel; they are read after registering, so no delta falls between.
+    // When any call fails everything is unregistered again, a batch that
+    // failed halfway included, before the error is passed on.
+    virtual StopBoardList subscribe(const PassengerPrx &p, const NameList &stopNames, const NameList &stockNumbers, const Ice::Current& = Ice::Current()) override {
+        if (p->ice_getEndpoints().empty() && p->ice_getAdapterId().empty())
+            throw std::runtime_error("passenger has no endpoints");
+        std::map<std::string, StopSeq> stopsByServer;
+        TramSeq trams;
+        StopSeq stops;
+        resolve(stopNames, stockNumbers, stopsByServer, trams, stops);
+
+        StopBoardList boards;
+        try {
+            std::vector<Ice::AsyncResultPtr> stopCalls, tramCalls;
+            for (const auto &kv : stopsByServer)
+                stopCalls.push_back(kv.second.front()->begin_RegisterPassengerBatch(kv.second, p));
+            for (const auto &tram : trams)
+                tramCalls.push_back(tram->begin_RegisterPassenger(p));
+            std::exception_ptr error;
+            for (const auto &r : stopCalls) {
+                try {
+                    TramStopPrx::uncheckedCast(r->getProxy())->end_RegisterPassengerBatch(r);
+                } catch (const Ice::Exception &) {
+                    error = std::current_exception();
+                }
+            }
+            for (const auto &r : tramCalls) {
+                try {
+                    TramPrx::uncheckedCast(r->getProxy())->end_RegisterPassenger(r);
+                } catch (const Ice::Exception &) {
+                    error = std::current_exception();
+                }
+            }
+            if (error)
+                std::rethrow_exception(error);
+
+            std::vector<Ice::AsyncResultPtr> boardCalls;
+            for (const auto &stop : stops)
+                boardCalls.push_back(stop->begin_getBoard());
+            for (size_t i = 0; i < stops.size(); i++) {
+                StopBoard board;
+                board.stop = stops[i];
+                board.upserts = stops[i]->end_getBoard(board.seq, boardCalls[i]);
+                boards.push_back(board);
+            }
+        } catch (const Ice::Exception &ex) {
+            std::cerr << "subscribe failed, undoing it: " << ex << std::endl;
+            unregisterAll(p, stopsByServer, trams);
+            throw;
+        }
+        std::cout << "passenger subscribed to " << stopNames.size() << " stops and " << trams.size() << " trams" << std::endl;
+        return boards;
+    }
+
+    // errors are only logged, used to undo a subscribe
+    void unregisterAll(const PassengerPrx &p, const std::map<std::string, StopSeq> &stopsByServer, const TramSeq &trams) {
+        std::vector<Ice::AsyncResultPtr> stopCalls, tramCalls;
+        for (const auto &kv : stopsByServer)
+            stopCalls.push_back(kv.second.front()->begin_UnregisterPassengerBatch(kv.second, p));
+        for (const auto &tram : trams)
+            tramCalls.push_back(tram->begin_UnregisterPassenger(p));
+        for (const auto &r : stopCalls) {
+            try {
+                TramStopPrx::uncheckedCast(r->getProxy())->end_UnregisterPassengerBatch(r);
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "cant undo subscribe at stop: " << ex << std::endl;
+            }
+        }
+        for (const auto &r : tramCalls) {
+            try {
+                TramPrx::uncheckedCast(r->getProxy())->end_UnregisterPassenger(r);
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "cant undo subscribe at tram: " << ex << std::endl;
+            }
+        }
+    }
+
+    // names that are gone by now (a tram that left its line) are skipped,
+    // the passenger is still unregistered from the rest
+    virtual void unsubscribe(const PassengerPrx &p, const NameList &stopNames, const NameList &stockNumbers, const Ice::Current& = Ice::Current()) override {
+        std::map<std::string, StopSeq> stopsByServer;
+        TramSeq trams;
+        StopSeq stops;
+        resolve(stopNames, stockNumbers, stopsByServer, trams, stops, true);
+
+        std::vector<Ice::AsyncResultPtr> stopCalls, tramCalls;
+        for (const auto &kv : stopsByServer)
+            stopCalls.push_back(kv.second.front()->begin_UnregisterPassengerBatch(kv.second, p));
+        for (const auto &tram : trams)
+            tramCalls.push_back(tram->begin_UnregisterPassenger(p));
+        for (const auto &r : stopCalls)
+            TramStopPrx::uncheckedCast(r->getProxy())->end_UnregisterPassengerBatch(r);
+        for (const auto &r : tramCalls)
+            TramPrx::uncheckedCast(r->getProxy())->end_UnregisterPassenger(r);
+    }
+
+    virtual LinePrx createLine(const std::string &name, const Ice::Current& = Ice::Current()) override {
+        Reservation reservation(*this, "line:" + name);
+        auto snapshot = readCatalog();
+        for (const auto &l : snapshot->lines) {
+            if (l->ice_getIdentity().name == name)
+                return l;
+        }
+        LineFactoryPrx factory = hashPlacement
+                                 ? ringOwner<LineFactoryPrx>(snapshot->lineRing, name)
+                                 : leastLoaded(snapshot->lineFactories);
+        if (!factory)
+            throw std::runtime_error("no line factory registered");
+
+        LinePrx line = factory->createLine(name);
+        updateCatalog([&](MPKCatalog &c) {
+            for (const auto &l : c.lines) {
+                if (l->ice_getIdentity() == line->ice_getIdentity())
+                    return;
+            }
+            c.lines.push_back(line);
+            persist("line/" + line->ice_getIdentity().name, line);
+        });
+        return line;
+    }
+
+    virtual TramStopPrx createStop(const std::string &name, const Ice::Current& = Ice::Current()) override {
+        Reservation reservation(*this, "stop:" + name);
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(stopsMtx);
+            auto it = tramStops.find(name);
+            if (it != tramStops.end())
+                return it->second;
+        }
+
+        auto snapshot = readCatalog();
+        StopFactoryPrx factory = hashPlacement ? ringOwner<StopFactoryPrx>(snapshot->stopRing, name)
+                                               : leastLoaded(snapshot->stopFactories);
+        if (!factory)
+            throw std::runtime_error("no stop factory registered");
+
+        TramStopPrx stop = factory->createStop(name);
+        std::unique_lock<std::shared_timed_mutex> lock(stopsMtx);
+        tramStops[name] = stop;
+        persist("stop/" + name, stop);
+        return stop;
+    }
+
+    // called periodically from a timer thread, unreachable factories are
+    // left with their last known load
+    void refreshLoads() {
+        auto snapshot = readCatalog();
+        std::map<std::string, double> fresh;
+        for (const auto &f : snapshot->lineFactories) {
+            try {
+                fresh[f->ice_toString()] = f->getLoad();
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "cant get load of line factory: " << ex << std::endl;
+            }
+        }
+        for (const auto &f : snapshot->stopFactories) {
+            try {
+                fresh[f->ice_toString()] = f->getLoad();
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "cant get load of stop factory: " << ex << std::endl;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(loadsMtx);
+        for (const auto &kv : fresh)
+            loads[kv.first] = kv.second;
+    }
+
+    void setPlacement(const std::string &policy) {
+        hashPlacement = policy != "load";
+    }
+
+    void setLiveness(int timeoutMs, int maxFailures) {
+        livenessTimeoutMs = std::max(timeoutMs, 1);
+        livenessMaxFailures = std::max(maxFailures, 1);
+    }
+
+    // Pings every registered factory, relay and tram in parallel, called
+    // periodically from a timer thread. One that missed livenessMaxFailures
+    // checks in a row is unregistered and forgotten by the store, a tram
+    // also at its line, so entries of processes that died without
+    // unregistering do not stay forever.
+    void checkLiveness() {
+        auto snapshot = readCatalog();
+        std::map<std::string, Ice::ObjectPrx> targets;
+        for (const auto &lf : snapshot->lineFactories)
+            targets["lf:" + lf->ice_toString()] = lf;
+        for (const auto &sf : snapshot->stopFactories)
+            targets["sf:" + sf->ice_toString()] = sf;
+        for (const auto &relay : snapshot->relays)
+            targets["relay:" + relay->ice_toString()] = relay;
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(directoryMtx);
+            for (const auto &kv : directory.trams)
+                targets["tram:" + kv.first] = kv.second;
+        }
+
+        std::vector<std::pair<std::string, Ice::AsyncResultPtr>> pings;
+        std::set<std::string> failed;
+        for (const auto &kv : targets) {
+            try {
+                pings.push_back(std::make_pair(kv.first, kv.second->ice_invocationTimeout(livenessTimeoutMs)->begin_ice_ping()));
+            } catch (const Ice::Exception &) {
+                failed.insert(kv.first);
+            }
+        }
+        for (const auto &ping : pings) {
+            try {
+                ping.second->getProxy()->end_ice_ping(ping.second);
+            } catch (const Ice::Exception &) {
+                failed.insert(ping.first);
+            }
+        }
+
+        std::vector<std::string> dead;
+        {
+            std::lock_guard<std::mutex> lock(missesMtx);
+            std::map<std::string, int> counted;
+            for (const auto &key : failed) {
+                int n = misses.count(key) ? misses[key] + 1 : 1;
+                if (n >= livenessMaxFailures)
+                    dead.push_back(key);
+                else
+                    counted[key] = n;
+            }
+            misses.swap(counted);
+        }
+
+        for (const auto &key : dead) {
+            std::cerr << "dropping unreachable " << key << std::endl;
+            const Ice::ObjectPrx &proxy = targets[key];
+            if (key.compare(0, 3, "lf:") == 0)
+                unregisterLineFactory(LineFactoryPrx::uncheckedCast(proxy));
+            else if (key.compare(0, 3, "sf:") == 0)
+                unregisterStopFactory(StopFactoryPrx::uncheckedCast(proxy));
+            else if (key.compare(0, 6, "relay:") == 0)
+                unregisterRelay(RelayPrx::uncheckedCast(proxy));
+            else
+                dropTram(TramPrx::uncheckedCast(proxy));
+        }
+    }
+
+    void dropTram(const TramPrx &tram) {
+        std::string line;
+        {
+            std::unique_lock<std::shared_timed_mutex> lock(directoryMtx);
+            auto it = directory.byIdentity.find(tram->ice_getIdentity());
+            if (it == directory.byIdentity.end())
+                return;
+            line = directory.lineOf(it->second);
+            forget("tram/" + directory.remove(tram));
+        }
+        if (line.empty())
+            return;
+        for (const auto &l : readCatalog()->lines) {
+            if (l->ice_getIdentity().name != line)
+                continue;
+            try {
+                LinePrx::uncheckedCast(l->ice_oneway())->unregisterTram(tram);
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "cant remove tram from line " << line << ": " << ex << std::endl;
+            }
+        }
+    }
+
+    void addTramStop(const TramStopPrx &ts) {
+        std::string name = ts->getName();
+        std::unique_lock<std::shared_timed_mutex> lock(stopsMtx);
+        tramStops[name] = ts;
+        persist("stop/" + name, ts);
+    }
+    void addLine(const LinePrx &lineProxy) {
+        updateCatalog([&](MPKCatalog &c) {
+            c.lines.push_back(lineProxy);
+            persist("line/" + lineProxy->ice_getIdentity().name, lineProxy);
+        });
+    }
+
+    // Creates every stop and line of the network with one batch call per
+    // factory, all factories in parallel, then sets the stop lists of all
+    // lines concurrently and publishes the catalog once.
+    void loadNetwork(const Network &network) {
+        auto snapshot = readCatalog();
+
+        // stop names grouped by the factory placing them
+        std::map<std::string, std::pair<StopFactoryPrx, NameList>> stopGroups;
+        std::map<std::string, TramStopPrx> stops;
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(stopsMtx);
+            for (const auto &name : network.stops) {
+                auto it = tramStops.find(name);
+                if (it != tramStops.end())
+                    stops[name] = it->second;
+            }
+        }
+        for (const auto &name : network.stops) {
+            if (stops.count(name))
+                continue;
+            StopFactoryPrx factory = hashPlacement ? ringOwner<StopFactoryPrx>(snapshot->stopRing, name)
+                                                   : leastLoaded(snapshot->stopFactories);
+            if (!factory)
+                throw std::runtime_error("no stop factory registered");
+            auto &group = stopGroups[factory->ice_toString()];
+            group.first = factory;
+            group.second.push_back(name);
+        }
+
+        std::map<std::string, std::pair<LineFactoryPrx, NameList>> lineGroups;
+        for (const auto &line : network.lines) {
+            LineFactoryPrx factory = hashPlacement ? ringOwner<LineFactoryPrx>(snapshot->lineRing, line.name)
+                                                   : leastLoaded(snapshot->lineFactories);
+            if (!factory)
+                throw std::runtime_error("no line factory registered");
+            auto &group = lineGroups[factory->ice_toString()];
+            group.first = factory;
+            group.second.push_back(line.name);
+        }
+
+        std::vector<std::pair<const NameList*, Ice::AsyncResultPtr>> stopCalls, lineCalls;
+        for (const auto &kv : stopGroups)
+            stopCalls.push_back(std::make_pair(&kv.second.second, kv.second.first->begin_createStops(kv.second.second)));
+        for (const auto &kv : lineGroups)
+            lineCalls.push_back(std::make_pair(&kv.second.second, kv.second.first->begin_createLines(kv.second.second)));
+
+        std::map<std::string, TramStopPrx> created;
+        for (const auto &call : stopCalls) {
+            StopSeq result = StopFactoryPrx::uncheckedCast(call.second->getProxy())->end_createStops(call.second);
+            for (size_t i = 0; i < result.size() && i < call.first->size(); i++)
+                created[(*call.first)[i]] = result[i];
+        }
+        stops.insert(created.begin(), created.end());
+        {
+            std::unique_lock<std::shared_timed_mutex> lock(stopsMtx);
+            for (const auto &kv : created) {
+                tramStops[kv.first] = kv.second;
+                persist("stop/" + kv.first, kv.second);
+            }
+        }
+
+        std::map<std::string, LinePrx> lines;
+        for (const auto &call : lineCalls) {
+            LineList result = LineFactoryPrx::uncheckedCast(call.second->getProxy())->end_createLines(call.second);
+            for (size_t i = 0; i < result.size() && i < call.first->size(); i++)
+                lines[(*call.first)[i]] = result[i];
+        }
+
+        updateCatalog([&](MPKCatalog &c) {
+            std::set<Ice::Identity> known;
+            for (const auto &l : c.lines)
+                known.insert(l->ice_getIdentity());
+            for (const auto &kv : lines) {
+                if (!known.insert(kv.second->ice_getIdentity()).second)
+                    continue;
+                c.lines.push_back(kv.second);
+                persist("line/" + kv.second->ice_getIdentity().name, kv.second);
+            }
+        });
+
+        std::vector<Ice::AsyncResultPtr> stopLists;
+        for (const auto &line : network.lines) {
+            StopList list;
+            for (const auto &stop : line.stops) {
+                StopInfo info;
+                info.time.ms = stop.offset * 60 * 1000LL;
+                info.stop = stops[stop.name];
+                info.name = stop.name;
+                list.push_back(info);
+            }
+            stopLists.push_back(lines[line.name]->begin_setStops(list));
+        }
+        for (const auto &r : stopLists)
+            LinePrx::uncheckedCast(r->getProxy())->end_setStops(r);
+    }
+
+    // loads the registry persisted in s and keeps writing to it, returns
+    // false when there was nothing to recover
+    bool recover(const StorePtr &s) {
+        auto c = std::make_shared<MPKCatalog>();
+        TramDirectory d;
+        std::unordered_map<std::string, TramStopPrx> stops;
+
+        for (const auto &kv : s->scan("mpk/depo/"))
+            s->decode(kv.second, c->depos[kv.first]);
+        for (const auto &kv : s->scan("mpk/line/")) {
+            LinePrx line;
+            s->decode(kv.second, line);
+            c->lines.push_back(line);
+        }
+        for (const auto &kv : s->scan("mpk/stop/"))
+            s->decode(kv.second, stops[kv.first]);
+        for (const auto &kv : s->scan("mpk/lf/")) {
+            LineFactoryPrx factory;
+            s->decode(kv.second, factory);
+            c->lineFactories.push_back(factory);
+            c->lineRing.add(factory);
+        }
+        for (const auto &kv : s->scan("mpk/sf/")) {
+            StopFactoryPrx factory;
+            s->decode(kv.second, factory);
+            c->stopFactories.push_back(factory);
+            c->stopRing.add(factory);
+        }
+        for (const auto &kv : s->scan("mpk/relay/")) {
+            RelayPrx relay;
+            s->decode(kv.second, relay);
+            c->relays.push_back(relay);
+        }
+        for (const auto &kv : s->scan("mpk/tram/")) {
+            TramPrx tram;
+            std::string line;
+            s->decode(kv.second, tram, line);
+            d.add(kv.first, tram, line);
+        }
+
+        std::lock_guard<std::mutex> lock(writeMtx);
+        std::unique_lock<std::shared_timed_mutex> directoryLock(directoryMtx);
+        std::unique_lock<std::shared_timed_mutex> stopsLock(stopsMtx);
+        store = s;
+        std::atomic_store(&catalog, std::shared_ptr<const MPKCatalog>(c));
+        directory = d;
+        tramStops.swap(stops);
+        std::cout << "recovered " << c->lines.size() << " lines, " << tramStops.size() << " stops, "
+             << c->depos.size() << " depos, " << d.trams.size() << " trams" << std::endl;
+        return !c->lines.empty();
+    }
+};
+inline Ice::ObjectPtr createMPKImpl() {
+    return new MPKImpl();
+}
+
+class LoadRefreshTask : public IceUtil::TimerTask {
+    Ice::ObjectPtr servant;
+public:
+    LoadRefreshTask(MPKImpl *mpk) : servant(mpk) {}
+    virtual void runTimerTask() override {
+        dynamic_cast<MPKImpl*>(servant.get())->refreshLoads();
+    }
+};
+
+class LivenessTask : public IceUtil::TimerTask {
+    Ice::ObjectPtr servant;
+public:
+    LivenessTask(MPKImpl *mpk) : servant(mpk) {}
+    virtual void runTimerTask() override {
+        dynamic_cast<MPKImpl*>(servant.get())->checkLiveness();
+    }
+};
+
+// Trams reach the MPK directory through their line, a depo only tracks
+// which trams are parked there.
+class DepoImpl : public Depo {
+    std::string name;
+    std::set<TramPrx> onlineTrams;
+    std::mutex mtx;
+public:
+    DepoImpl(const std::string &n) : name(n) {}
+    virtual void TramOnline(const TramPrx &t, const Ice::Current& = Ice::Current()) override {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            onlineTrams.insert(t);
+        }
+        std::cout << "tram " << t->getStockNumber() << " is online at " << name << "depo" <<  std::endl;
+    }
+    virtual void TramOffline(const TramPrx &t, const Ice::Current& = Ice::Current()) override {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            onlineTrams.erase(t);
+        }
+        std::cout << "tram " << t->getStockNumber() << " is offline at " << name << "depo" << std::endl;
+    }
+    virtual std::string getName(const Ice::Current& = Ice::Current()) override {
+        return name;
+    }
+};
+
+inline Ice::ObjectPtr createDepoImpl(const std::string &name) {
+    return new DepoImpl(name);
+}
+
+
+#endif
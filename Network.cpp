@@ -0,0 +1,128 @@
+#include <Network.h>
+#include <stdexcept>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace {
+
+class Parser {
+    const char *p;
+    const char *end;
+    int line = 1;
+    string path;
+
+    bool blank(char c) const {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+public:
+    Parser(const char *begin, size_t size, const string &file) : p(begin), end(begin + size), path(file) {}
+
+    [[noreturn]] void fail(const string &what) const {
+        throw runtime_error(path + ":" + to_string(line) + ": " + what);
+    }
+
+    bool atEnd() const {
+        return p == end;
+    }
+
+    // next token on the current line, empty at its end or at a comment
+    string token() {
+        while (p != end && blank(*p))
+            p++;
+        if (p == end || *p == '\n' || *p == '#')
+            return string();
+        const char *start = p;
+        while (p != end && !blank(*p) && *p != '\n' && *p != '#')
+            p++;
+        return string(start, p);
+    }
+
+    void nextLine() {
+        while (p != end && *p != '\n')
+            p++;
+        if (p != end) {
+            p++;
+            line++;
+        }
+    }
+};
+
+}
+
+Network loadNetwork(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("cant open " + path);
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        throw runtime_error("cant stat " + path);
+    }
+
+    Network network;
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        close(fd);
+        return network;
+    }
+    void *mapped = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        throw runtime_error("cant map " + path);
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    unordered_set<string> declared;
+    auto declare = [&](const string &name) {
+        if (declared.insert(name).second)
+            network.stops.push_back(name);
+    };
+
+    try {
+        Parser parser(static_cast<const char*>(mapped), size, path);
+        for (; !parser.atEnd(); parser.nextLine()) {
+            string kind = parser.token();
+            if (kind.empty())
+                continue;
+
+            if (kind == "stop") {
+                string name = parser.token();
+                if (name.empty())
+                    parser.fail("stop without a name");
+                declare(name);
+            } else if (kind == "line") {
+                NetworkLine line;
+                line.name = parser.token();
+                if (line.name.empty())
+                    parser.fail("line without a name");
+                for (string entry = parser.token(); !entry.empty(); entry = parser.token()) {
+                    size_t colon = entry.rfind(':');
+                    if (colon == string::npos || colon == 0 || colon + 1 == entry.size())
+                        parser.fail("expected <stop>:<minutes>, got " + entry);
+                    NetworkStop stop;
+                    stop.name = entry.substr(0, colon);
+                    try {
+                        stop.offset = stoi(entry.substr(colon + 1));
+                    } catch (const exception &) {
+                        parser.fail("bad offset in " + entry);
+                    }
+                    declare(stop.name);
+                    line.stops.push_back(stop);
+                }
+                network.lines.push_back(line);
+            } else {
+                parser.fail("unknown record " + kind);
+            }
+        }
+    } catch (...) {
+        munmap(mapped, size);
+        throw;
+    }
+    munmap(mapped, size);
+    return network;
+}
@@ -0,0 +1,36 @@
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include <string>
+#include <vector>
+
+// Network description loaded at startup (MPK.Network). One record per line,
+// '#' starts a comment:
+//
+//   stop <name>
+//   line <name> <stop>:<minutes> <stop>:<minutes> ...
+//
+// minutes are offsets from the start of the line. Stops only named in a
+// line are declared implicitly.
+
+
+struct NetworkStop {
+    std::string name;
+    int offset;
+};
+
+struct NetworkLine {
+    std::string name;
+    std::vector<NetworkStop> stops;
+};
+
+struct Network {
+    std::vector<std::string> stops;
+    std::vector<NetworkLine> lines;
+};
+
+// memory-maps path and parses it, throws runtime_error with the file
+// position on a malformed record
+Network loadNetwork(const std::string &path);
+
+#endif
@@ -0,0 +1,353 @@
+#include <Ice/Ice.h>
+#include <SIP.h>
+#include <Servants.h>
+#include <iostream>
+
+using namespace std;
+using namespace SIP;
+
+// Standalone fan-out process. A relay registers itself once as the passenger
+// <relay id>/stop:<name> or <relay id>/tram:<stock number> at the stop or
+// tram and forwards every update it receives, still encoded, to its own subscribers
+// through the notification dispatcher. Stops and trams then call one relay
+// instead of every passenger; more relays can run side by side. Topics live
+// in memory only: a relay restarting with the same id (MPK.Relay.Id,
+// relay<port> by default) and port still gets updates for its old topics,
+// answers each by leaving that stop or tram, and its passengers subscribe
+// again.
+
+struct Topic {
+    set<PassengerPrx> passengers;
+    SubscriberList subscribers = make_shared<vector<PassengerPrx>>();
+    // unregisters the relay at the stop or tram, set once it is registered
+    function<void()> detach;
+};
+
+class RelayImpl : public Relay {
+    Ice::ObjectAdapterPtr adapter;
+    MPKPrx mpk;
+    string id;
+    mutex mtx;
+    map<string, Topic> topics;
+    // unknown topics whose stop or tram is being left
+    set<string> detaching;
+
+    // looks up the stop or tram of an unknown topic and unregisters the relay there
+    class Detach : public IceUtil::Shared {
+        Ice::ObjectPtr relay;
+        string topic;
+        PassengerPrx self;
+
+        void done() {
+            RelayImpl *r = dynamic_cast<RelayImpl*>(relay.get());
+            lock_guard<mutex> lock(r->mtx);
+            r->detaching.erase(topic);
+        }
+
+    public:
+        Detach(RelayImpl *r, const string &t, const PassengerPrx &p) : relay(r), topic(t), self(p) {}
+
+        void stopFound(const Ice::AsyncResultPtr &result) {
+            try {
+                TramStopPrx stop = MPKPrx::uncheckedCast(result->getProxy())->end_getTramStop(result);
+                TramStopPrx::uncheckedCast(stop->ice_oneway())->begin_UnregisterPassenger(self);
+                cout << "left " << topic << ", nobody is subscribed" << endl;
+            } catch (const exception &ex) {
+                cerr << "cant leave " << topic << ": " << ex.what() << endl;
+            }
+            done();
+        }
+
+        void tramFound(const Ice::AsyncResultPtr &result) {
+            try {
+                TramPrx tram = MPKPrx::uncheckedCast(result->getProxy())->end_findTram(result);
+                if (tram) {
+                    TramPrx::uncheckedCast(tram->ice_oneway())->begin_UnregisterPassenger(self);
+                    cout << "left " << topic << ", nobody is subscribed" << endl;
+                }
+            } catch (const exception &ex) {
+                cerr << "cant leave " << topic << ": " << ex.what() << endl;
+            }
+            done();
+        }
+    };
+    typedef IceUtil::Handle<Detach> DetachPtr;
+
+    // called for updates of a topic the relay does not know, without waiting
+    void detachUnknown(const string &topic) {
+        {
+            lock_guard<mutex> lock(mtx);
+            if (!detaching.insert(topic).second)
+                return;
+        }
+        DetachPtr d = new Detach(this, topic, topicProxy(topic));
+        try {
+            if (topic.compare(0, 5, "stop:") == 0) {
+                mpk->begin_getTramStop(topic.substr(5), Ice::newCallback(d, &Detach::stopFound));
+                return;
+            }
+            if (topic.compare(0, 5, "tram:") == 0) {
+                mpk->begin_findTram(topic.substr(5), Ice::newCallback(d, &Detach::tramFound));
+                return;
+            }
+        } catch (const Ice::Exception &ex) {
+            cerr << "cant leave " << topic << ": " << ex << endl;
+        }
+        lock_guard<mutex> lock(mtx);
+        detaching.erase(topic);
+    }
+
+    PassengerPrx topicProxy(const string &topic) {
+        Ice::Identity identity;
+        identity.category = id;
+        identity.name = topic;
+        return PassengerPrx::uncheckedCast(adapter->createProxy(identity));
+    }
+
+    static void publish(Topic &t) {
+        t.subscribers = make_shared<vector<PassengerPrx>>(t.passengers.begin(), t.passengers.end());
+    }
+
+    // attach registers the relay upstream and returns how to undo it
+    void subscribe(const string &topic, const PassengerPrx &p, const function<function<void()>()> &attach) {
+        // the topic exists while attaching, so an update arriving before
+        // attach returns is not taken for one of an unknown topic
+        bool attached;
+        {
+            lock_guard<mutex> lock(mtx);
+            attached = static_cast<bool>(topics[topic].detach);
+        }
+        function<void()> detach;
+        if (!attached) {
+            try {
+                detach = attach();
+            } catch (...) {
+                lock_guard<mutex> lock(mtx);
+                auto it = topics.find(topic);
+                if (it != topics.end() && it->second.passengers.empty() && !it->second.detach)
+                    topics.erase(it);
+                throw;
+            }
+        }
+
+        lock_guard<mutex> lock(mtx);
+        Topic &t = topics[topic];
+        if (!t.detach)
+            t.detach = detach;
+        t.passengers.insert(p);
+        publish(t);
+        cout << "passenger subscribed to " << topic << " (" << t.passengers.size() << ")" << endl;
+    }
+
+    // updates of a topic are posted with the topic as their owner
+    void unsubscribe(const string &topic, const PassengerPrx &p) {
+        function<void()> detach;
+        {
+            lock_guard<mutex> lock(mtx);
+            auto it = topics.find(topic);
+            if (it == topics.end() || !it->second.passengers.erase(p))
+                return;
+            notifier->release(&it->second, p);
+            publish(it->second);
+            if (it->second.passengers.empty()) {
+                detach = it->second.detach;
+                topics.erase(it);
+            }
+        }
+        if (detach) {
+            try {
+                detach();
+            } catch (const Ice::Exception &ex) {
+                cerr << "cant leave " << topic << ": " << ex << endl;
+            }
+        }
+    }
+
+public:
+    RelayImpl(const Ice::ObjectAdapterPtr &a, const MPKPrx &m, const string &relayId) : adapter(a), mpk(m), id(relayId) {}
+
+    virtual void subscribeStop(const string &name, const PassengerPrx &p, const Ice::Current &current = Ice::Current()) override {
+        string topic = "stop:" + name;
+        subscribe(topic, callbackProxy(p, current), [this, name, topic] {
+            TramStopPrx stop = mpk->getTramStop(name);
+            PassengerPrx self = topicProxy(topic);
+            stop->RegisterPassenger(self);
+            return function<void()>([stop, self] { stop->UnregisterPassenger(self); });
+        });
+    }
+
+    virtual void unsubscribeStop(const string &name, const PassengerPrx &p, const Ice::Current &current = Ice::Current()) override {
+        unsubscribe("stop:" + name, callbackProxy(p, current));
+    }
+
+    virtual void subscribeTram(const string &stockNumber, const PassengerPrx &p, const Ice::Current &current = Ice::Current()) override {
+        string topic = "tram:" + stockNumber;
+        subscribe(topic, callbackProxy(p, current), [this, stockNumber, topic] {
+            TramPrx tram = mpk->findTram(stockNumber);
+            if (!tram)
+                throw runtime_error("tram not found");
+            PassengerPrx self = topicProxy(topic);
+            tram->RegisterPassenger(self);
+            return function<void()>([tram, self] { tram->UnregisterPassenger(self); });
+        });
+    }
+
+    virtual void unsubscribeTram(const string &stockNumber, const PassengerPrx &p, const Ice::Current &current = Ice::Current()) override {
+        unsubscribe("tram:" + stockNumber, callbackProxy(p, current));
+    }
+
+    // called with the encoded parameters of an update for topic
+    void forward(const string &topic, const string &operation, const vector<Ice::Byte> &params) {
+        SubscriberList subs;
+        const Topic *owner = nullptr;
+        {
+            lock_guard<mutex> lock(mtx);
+            auto it = topics.find(topic);
+            if (it != topics.end()) {
+                subs = it->second.subscribers;
+                owner = &it->second;
+            }
+        }
+        if (!subs) {
+            detachUnknown(topic);
+            return;
+        }
+
+        NotificationPtr n = new Notification;
+        n->operation = operation;
+        n->params = params;
+        Ice::ObjectPtr self = this;
+        notifier->post(subs, n, owner, [self, topic](const PassengerPrx &p) {
+            dynamic_cast<RelayImpl*>(self.get())->unsubscribe(topic, p);
+        });
+    }
+
+    void printTopics() {
+        lock_guard<mutex> lock(mtx);
+        if (topics.empty()) {
+            cout << "no topics" << endl;
+            return;
+        }
+        for (const auto &kv : topics)
+            cout << "- " << kv.first << ": " << kv.second.passengers.size() << " passengers" << endl;
+    }
+
+    void detachAll() {
+        map<string, Topic> all;
+        {
+            lock_guard<mutex> lock(mtx);
+            all.swap(topics);
+        }
+        for (const auto &kv : all) {
+            try {
+                if (kv.second.detach)
+                    kv.second.detach();
+            } catch (const Ice::Exception &ex) {
+                cerr << "cant leave " << kv.first << ": " << ex << endl;
+            }
+        }
+    }
+};
+
+// Receives the Passenger calls for every topic of the relay without decoding them.
+class TopicForwarder : public Ice::Blobject {
+    Ice::ObjectPtr relay;
+public:
+    TopicForwarder(RelayImpl *r) : relay(r) {}
+
+    virtual bool ice_invoke(const vector<Ice::Byte> &inParams, vector<Ice::Byte> &, const Ice::Current &current) override {
+        dynamic_cast<RelayImpl*>(relay.get())->forward(current.id.name, current.operation, inParams);
+        return true;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <port>" << endl;
+        return 1;
+    }
+
+    int port;
+    try {
+        port = stoi(argv[1]);
+    } catch (const exception &ex) {
+        cerr << "invalid port: " << ex.what() << endl;
+        return 2;
+    }
+
+    int status = 0;
+    Ice::CommunicatorPtr ic;
+
+    try {
+        ic = Ice::initialize(argc, argv);
+        initServants(ic);
+
+        Ice::ObjectAdapterPtr adapter = ic->createObjectAdapterWithEndpoints(
+                "RelayAdapter", "default -p " + to_string(port));
+        MPKPrx mpk = MPKPrx::uncheckedCast(ic->stringToProxy("MPK:default -p 10000"));
+
+        // topics are registered under the relay id so relays never share identities at a stop
+        string relayId = ic->getProperties()->getPropertyWithDefault("MPK.Relay.Id", "relay" + to_string(port));
+        RelayImpl *relayImpl = new RelayImpl(adapter, mpk, relayId);
+        RelayPrx relay = RelayPrx::uncheckedCast(adapter->add(relayImpl, Ice::stringToIdentity("Relay")));
+        adapter->addDefaultServant(new TopicForwarder(relayImpl), relayId);
+        adapter->activate();
+
+        try {
+            mpk->registerRelay(relay);
+            cout << "relay registered at mpk" << endl;
+        } catch (const Ice::Exception &ex) {
+            cerr << "cant register at mpk: " << ex << endl;
+            destroyServants(ic);
+            ic->destroy();
+            return 3;
+        }
+
+        cout << "commands:" << endl;
+        cout << "  topics - show topics and their passengers" << endl;
+        cout << "  exit   - exit" << endl;
+
+        bool running = true;
+        string command;
+        while (running) {
+            cout << "\nenter command: ";
+            if (!getline(cin, command))
+                break;
+
+            istringstream iss(command);
+            string cmd;
+            iss >> cmd;
+
+            if (cmd == "exit") {
+                running = false;
+                cout << "closing..." << endl;
+            } else if (cmd == "topics") {
+                relayImpl->printTopics();
+            } else {
+                cout << "unknown command" << endl;
+            }
+        }
+
+        try {
+            mpk->unregisterRelay(relay);
+        } catch (const Ice::Exception &ex) {
+            cerr << "cant unregister from mpk: " << ex << endl;
+        }
+        relayImpl->detachAll();
+
+        destroyServants(ic);
+        ic->destroy();
+    } catch (const Ice::Exception &ex) {
+        cerr << ex << endl;
+        destroyServants(ic);
+        if (ic) {
+            try {
+                ic->destroy();
+            } catch (const Ice::Exception &) {
+            }
+        }
+        status = 1;
+    }
+
+    return status;
+}
@@ -0,0 +1,39 @@
+#include <Servants.h>
+
+using namespace std;
+
+NotificationDispatcherPtr notifier;
+IceUtil::TimerPtr flushTimer;
+TimerWheelPtr expiryWheel;
+int defaultCoalesceWindowMs = 100;
+
+void initServants(const Ice::CommunicatorPtr &ic) {
+    Ice::PropertiesPtr props = ic->getProperties();
+    defaultCoalesceWindowMs = props->getPropertyAsIntWithDefault("MPK.Stop.CoalesceMs", defaultCoalesceWindowMs);
+    flushTimer = new IceUtil::Timer();
+    expiryWheel = new TimerWheel(props->getPropertyAsIntWithDefault("MPK.Expiry.TickMs", 100));
+    notifier = new NotificationDispatcher(ic,
+                                          props->getPropertyAsIntWithDefault("MPK.Notify.Workers", 2),
+                                          props->getPropertyAsIntWithDefault("MPK.Notify.QueueLimit", 64),
+                                          props->getPropertyAsIntWithDefault("MPK.Notify.MaxFailures", 3));
+}
+
+void destroyServants(const Ice::CommunicatorPtr &ic) {
+    // a running dispatch may still post a notification or schedule a timer
+    if (ic) {
+        ic->shutdown();
+        ic->waitForShutdown();
+    }
+    if (expiryWheel) {
+        expiryWheel->destroy();
+        expiryWheel = 0;
+    }
+    if (flushTimer) {
+        flushTimer->destroy();
+        flushTimer = 0;
+    }
+    if (notifier) {
+        notifier->destroy();
+        notifier = 0;
+    }
+}
@@ -0,0 +1,1586 @@
+#ifndef SERVANTS_H
+#define SERVANTS_H
+
+#include <Ice/Ice.h>
+#include <SIP.h>
+#include <map>
+#include <list>
+#include <algorithm>
+#include <functional>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <cstring>
+#include <IceUtil/Timer.h>
+#include <Store.h>
+#include <Timetable.h>
+#include <Subscription.h>
+
+// Line and stop servants with their notification machinery, shared by the
+// System process and standalone factory processes.
+
+using namespace SIP;
+
+// [offset, offset + limit) of a sequence, clamped to its size
+template<class Seq>
+Seq sliceRange(const Seq &all, int offset, int limit, int &total) {
+    total = static_cast<int>(all.size());
+    size_t begin = std::min(static_cast<size_t>(std::max(offset, 0)), all.size());
+    size_t end = std::min(begin + static_cast<size_t>(std::max(limit, 0)), all.size());
+    return Seq(all.begin() + begin, all.begin() + end);
+}
+
+// Remote calls (stock number lookups, pushes to trams, the tram directory)
+// are made outside of mtx so a slow tram never blocks other dispatch threads.
+class LineImpl : public Line {
+public:
+    typedef LineState State;
+private:
+    std::string name;
+    MPKPrx mpk;
+    TramList trams;
+    StopList stops;
+    Ice::Long stopsVersion = 0;
+    StorePtr store;
+    std::mutex mtx;
+
+    State stateLocked() const {
+        State state;
+        state.trams = trams;
+        state.stops = stops;
+        state.stopsVersion = stopsVersion;
+        return state;
+    }
+
+    // write-through, called under mtx so records reach the log in order
+    void persistLocked() {
+        if (store)
+            store->write("linestate/" + name, stateLocked());
+    }
+public:
+    // the MPK proxy is used oneway, lines only report to the tram directory
+    LineImpl(const std::string &n, const MPKPrx &m, const StorePtr &s = 0)
+            : name(n), mpk(m ? MPKPrx::uncheckedCast(m->ice_oneway()) : m), store(s) {}
+
+    State saveState() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return stateLocked();
+    }
+
+    void restoreState(const State &state) {
+        std::lock_guard<std::mutex> lock(mtx);
+        trams = state.trams;
+        stops = state.stops;
+        stopsVersion = state.stopsVersion;
+    }
+
+    virtual TramList getTrams(const Ice::Current& = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        return trams;
+    }
+    virtual StopList getStops(const Ice::Current& = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        return stops;
+    }
+    virtual void registerTram(const TramPrx &tram, const Ice::Current& = Ice::Current()) override {
+        TramInfo info;
+        info.time.ms = 0;
+        info.tram = tram;
+        info.stockNumber = tram->getStockNumber();
+        info.line = name;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            // a tram registering again replaces its entry
+            auto it = std::find_if(trams.begin(), trams.end(), [&](const TramInfo &t) {
+                return t.tram->ice_getIdentity() == tram->ice_getIdentity();
+            });
+            if (it != trams.end())
+                *it = info;
+            else
+                trams.push_back(info);
+            persistLocked();
+        }
+        if (mpk)
+            mpk->registerTram(info);
+        std::cout << "registered tram " << info.stockNumber << " on line " << name << std::endl;
+    }
+    virtual void unregisterTram(const TramPrx &tram, const Ice::Current& = Ice::Current()) override {
+        std::string stockNumber;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = std::remove_if(trams.begin(), trams.end(), [&](const TramInfo &info) {
+                if (info.tram->ice_getIdentity() != tram->ice_getIdentity())
+                    return false;
+                stockNumber = info.stockNumber;
+                return true;
+            });
+            trams.erase(it, trams.end());
+            persistLocked();
+        }
+        if (mpk)
+            mpk->unregisterTram(tram);
+        std::cout << "unregistered tram " << stockNumber << " from line " << name << std::endl;
+    }
+    virtual void setStops(const StopList &sl, const Ice::Current &current = Ice::Current()) override {
+        StopList named = sl;
+        // stop servants are registered under their name, so a missing name
+        // is filled in without calling back into the stop
+        for (auto &info : named) {
+            if (info.name.empty() && info.stop)
+                info.name = info.stop->ice_getIdentity().name;
+        }
+
+        TramList targets;
+        Ice::Long version;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stops = named;
+            version = ++stopsVersion;
+            targets = trams;
+            persistLocked();
+        }
+        std::cout << "added stops for line  " << name << std::endl;
+
+        if (!current.adapter)
+            return;
+
+        // trams keep a copy of the stop list, push the new version instead of
+        // letting them poll getStops on every move
+        LinePrx self = LinePrx::uncheckedCast(current.adapter->createProxy(current.id));
+        for (const auto &info : targets) {
+            try {
+                TramPrx::uncheckedCast(info.tram->ice_oneway())->stopsChanged(self, version, named);
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "cant push stops to tram: " << ex << std::endl;
+            }
+        }
+    }
+    virtual std::string getName(const Ice::Current& = Ice::Current()) override {
+        return name;
+    }
+    virtual Ice::Long getStopsVersion(const Ice::Current& = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        return stopsVersion;
+    }
+    virtual StopList getStopsVersioned(Ice::Long &version, const Ice::Current& = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        version = stopsVersion;
+        return stops;
+    }
+    virtual TramList getTramsRange(int offset, int limit, int &total, const Ice::Current& = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        return sliceRange(trams, offset, limit, total);
+    }
+    virtual StopList getStopsRange(int offset, int limit, int &total, const Ice::Current& = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        return sliceRange(stops, offset, limit, total);
+    }
+};
+
+inline Ice::ObjectPtr createLineImpl(const std::string &name, const MPKPrx &mpk) {
+    return new LineImpl(name, mpk);
+}
+
+// A request marshaled once and shared by every subscriber it is sent to.
+// An element notification holds one element of the operation's only
+// (sequence) parameter; the dispatcher joins queued elements into one call.
+struct Notification : public IceUtil::Shared {
+    std::string operation;
+    std::vector<Ice::Byte> params;
+    bool element = false;
+};
+typedef IceUtil::Handle<Notification> NotificationPtr;
+typedef std::shared_ptr<const std::vector<PassengerPrx>> SubscriberList;
+
+// Delivers notifications to passengers from its own worker threads. post()
+// only queues the job, so the thread handling tram updates never waits for
+// the fan-out. Every subscriber has one request in flight at a time and a
+// bounded queue behind it; when the queue is full the oldest notification
+// is dropped (stop deltas carry a sequence number, the passenger resyncs).
+// A subscriber whose calls fail maxFailures times in a row is dead: its
+// queue is discarded and every owner that posted to it is told through the
+// DeadHandler it passed, later posts to the same proxy report it right away.
+// Element notifications waiting behind a request in flight are sent together
+// as one sequence, so a passenger of many stops gets one call per round trip.
+// A failing subscriber with nothing queued is kept while owners still post
+// to it. It is forgotten once its last owner calls release() or nobody posted
+// to it for idleMs.
+class NotificationDispatcher : public IceUtil::Shared {
+public:
+    typedef std::function<void(const PassengerPrx&)> DeadHandler;
+
+private:
+    struct Job {
+        SubscriberList subscribers;
+        NotificationPtr notification;
+        const void *owner;
+        DeadHandler onDead;
+    };
+    struct Subscriber {
+        PassengerPrx proxy;
+        std::deque<NotificationPtr> queue;
+        bool inFlight = false;
+        int failures = 0;
+        Ice::Long lastPost = 0;
+        std::map<const void*, DeadHandler> owners;
+    };
+
+    // keeps the dispatcher alive until the call completes, a completion
+    // arriving after destroy() finds no subscriber and does nothing
+    class Delivery : public IceUtil::Shared {
+        IceUtil::Handle<NotificationDispatcher> dispatcher;
+        std::string key;
+    public:
+        Delivery(NotificationDispatcher *d, const std::string &k) : dispatcher(d), key(k) {}
+
+        void completed(const Ice::AsyncResultPtr &r) {
+            bool ok = true;
+            try {
+                std::vector<Ice::Byte> out;
+                r->getProxy()->end_ice_invoke(out, r);
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "notification to " << key << " failed: " << ex << std::endl;
+                ok = false;
+            }
+            dispatcher->delivered(key, ok);
+        }
+    };
+    typedef IceUtil::Handle<Delivery> DeliveryPtr;
+
+    // dead proxies remembered for late posts, oldest forgotten first
+    static const size_t maxDead = 4096;
+    static const Ice::Long idleMs = 60 * 1000;
+
+    Ice::CommunicatorPtr ic;
+    size_t queueLimit;
+    int maxFailures;
+
+    std::mutex jobsMtx;
+    std::condition_variable jobsCv;
+    std::deque<Job> jobs;
+    bool destroyed = false;
+    std::vector<std::thread> workers;
+
+    std::mutex subscribersMtx;
+    std::unordered_map<std::string, Subscriber> subscribers;
+    std::unordered_map<std::string, PassengerPrx> dead;
+    std::deque<std::string> deadOrder;
+    Ice::Long dropped = 0;
+    Ice::Long pruned = 0;
+    Ice::Long lastSweep = 0;
+
+    static std::string keyOf(const PassengerPrx &p) {
+        Ice::Identity id = p->ice_getIdentity();
+        return id.category + "/" + id.name;
+    }
+
+    // splices encapsulations of one element each into an encapsulation of
+    // their sequence, no element is decoded again
+    static void joinElements(const std::vector<NotificationPtr> &elements, std::vector<Ice::Byte> &params) {
+        static const size_t header = 6;
+        size_t body = 0;
+        for (const auto &e : elements)
+            body += e->params.size() - header;
+        size_t count = elements.size();
+        size_t countSize = count < 255 ? 1 : 5;
+
+        params.resize(header + countSize + body);
+        Ice::Int size = static_cast<Ice::Int>(params.size());
+        for (int i = 0; i < 4; i++)
+            params[i] = static_cast<Ice::Byte>(size >> (8 * i));
+        // encoding version of the elements
+        params[4] = elements.front()->params[4];
+        params[5] = elements.front()->params[5];
+
+        Ice::Byte *p = &params[header];
+        if (countSize == 1) {
+            *p++ = static_cast<Ice::Byte>(count);
+        } else {
+            *p++ = 255;
+            for (int i = 0; i < 4; i++)
+                *p++ = static_cast<Ice::Byte>(count >> (8 * i));
+        }
+        for (const auto &e : elements) {
+            size_t n = e->params.size() - header;
+            if (n > 0)
+                memcpy(p, &e->params[header], n);
+            p += n;
+        }
+    }
+
+    void run() {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(jobsMtx);
+                jobsCv.wait(lock, [this] { return destroyed || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = jobs.front();
+                jobs.pop_front();
+            }
+            for (const auto &p : *job.subscribers)
+                enqueue(p, job);
+        }
+    }
+
+    void enqueue(const PassengerPrx &p, const Job &job) {
+        std::string key = keyOf(p);
+        bool isDead;
+        {
+            std::lock_guard<std::mutex> lock(subscribersMtx);
+            Ice::Long now = nowMs();
+            if (now - lastSweep >= idleMs)
+                sweepIdleLocked(now);
+            auto d = dead.find(key);
+            isDead = d != dead.end() && d->second == p;
+            if (!isDead) {
+                Subscriber &s = subscribers[key];
+                s.proxy = p;
+                s.lastPost = now;
+                if (job.onDead)
+                    s.owners[job.owner] = job.onDead;
+                if (s.queue.size() >= queueLimit) {
+                    s.queue.pop_front();
+                    dropped++;
+                }
+                s.queue.push_back(job.notification);
+                if (s.inFlight)
+                    return;
+            }
+        }
+        if (isDead) {
+            if (job.onDead)
+                job.onDead(p);
+            return;
+        }
+        deliver(key);
+    }
+
+    void deliver(const std::string &key) {
+        PassengerPrx proxy;
+        NotificationPtr n;
+        std::vector<NotificationPtr> elements;
+        {
+            std::lock_guard<std::mutex> lock(subscribersMtx);
+            auto it = subscribers.find(key);
+            if (it == subscribers.end() || it->second.inFlight)
+                return;
+            if (it->second.queue.empty()) {
+                // a failing subscriber is kept so its failures keep counting
+                if (it->second.failures == 0 || it->second.owners.empty())
+                    subscribers.erase(it);
+                return;
+            }
+            std::deque<NotificationPtr> &queue = it->second.queue;
+            n = queue.front();
+            queue.pop_front();
+            if (n->element) {
+                elements.push_back(n);
+                while (!queue.empty() && queue.front()->element && queue.front()->operation == n->operation) {
+                    elements.push_back(queue.front());
+                    queue.pop_front();
+                }
+            }
+            it->second.inFlight = true;
+            proxy = it->second.proxy;
+        }
+
+        try {
+            std::vector<Ice::Byte> joined;
+            if (!elements.empty())
+                joinElements(elements, joined);
+            DeliveryPtr cb = new Delivery(this, key);
+            proxy->begin_ice_invoke(n->operation, Ice::Normal, elements.empty() ? n->params : joined,
+                                    Ice::newCallback(cb, &Delivery::completed));
+        } catch (const Ice::Exception &ex) {
+            std::cerr << "cant notify " << key << ": " << ex << std::endl;
+            delivered(key, false);
+        }
+    }
+
+    void delivered(const std::string &key, bool ok) {
+        PassengerPrx proxy;
+        std::map<const void*, DeadHandler> owners;
+        {
+            std::lock_guard<std::mutex> lock(subscribersMtx);
+            auto it = subscribers.find(key);
+            if (it == subscribers.end())
+                return;
+            it->second.inFlight = false;
+            it->second.failures = ok ? 0 : it->second.failures + 1;
+            if (it->second.failures >= maxFailures) {
+                proxy = it->second.proxy;
+                owners.swap(it->second.owners);
+                dropped += it->second.queue.size();
+                subscribers.erase(it);
+                markDeadLocked(key, proxy);
+            }
+        }
+        if (proxy) {
+            std::cerr << "dropping subscriber " << key << " after " << maxFailures << " failed notifications" << std::endl;
+            for (const auto &kv : owners)
+                kv.second(proxy);
+            return;
+        }
+        deliver(key);
+    }
+
+    // idle subscribers whose owners went away without release()
+    void sweepIdleLocked(Ice::Long now) {
+        lastSweep = now;
+        for (auto it = subscribers.begin(); it != subscribers.end();) {
+            const Subscriber &s = it->second;
+            if (!s.inFlight && s.queue.empty() && now - s.lastPost >= idleMs)
+                it = subscribers.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    void markDeadLocked(const std::string &key, const PassengerPrx &proxy) {
+        pruned++;
+        if (dead.find(key) == dead.end())
+            deadOrder.push_back(key);
+        dead[key] = proxy;
+        while (deadOrder.size() > maxDead) {
+            dead.erase(deadOrder.front());
+            deadOrder.pop_front();
+        }
+    }
+
+public:
+    NotificationDispatcher(const Ice::CommunicatorPtr &communicator, int workerCount, size_t limit, int failures = 3)
+            : ic(communicator), queueLimit(std::max<size_t>(limit, 1)), maxFailures(std::max(failures, 1)) {
+        for (int i = 0; i < std::max(workerCount, 1); i++)
+            workers.emplace_back([this] { run(); });
+    }
+
+    const Ice::CommunicatorPtr &communicator() const {
+        return ic;
+    }
+
+    // owner identifies the poster, onDead is called (from a dispatcher or
+    // Ice thread) for each subscriber that is found dead
+    void post(const SubscriberList &subs, const NotificationPtr &n,
+              const void *owner = nullptr, const DeadHandler &onDead = DeadHandler()) {
+        if (!subs || subs->empty())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(jobsMtx);
+            jobs.push_back(Job{subs, n, owner, onDead});
+        }
+        jobsCv.notify_one();
+    }
+
+    // owner no longer posts to p; the subscriber goes with its last owner
+    // once nothing is queued or in flight for it
+    void release(const void *owner, const PassengerPrx &p) {
+        std::lock_guard<std::mutex> lock(subscribersMtx);
+        auto it = subscribers.find(keyOf(p));
+        if (it == subscribers.end())
+            return;
+        it->second.owners.erase(owner);
+        if (it->second.owners.empty() && it->second.queue.empty() && !it->second.inFlight)
+            subscribers.erase(it);
+    }
+
+    // a passenger subscribing again is given another chance
+    void revive(const PassengerPrx &p) {
+        std::lock_guard<std::mutex> lock(subscribersMtx);
+        auto d = dead.find(keyOf(p));
+        if (d != dead.end() && d->second == p)
+            dead.erase(d);
+    }
+
+    Ice::Long droppedCount() {
+        std::lock_guard<std::mutex> lock(subscribersMtx);
+        return dropped;
+    }
+
+    Ice::Long prunedCount() {
+        std::lock_guard<std::mutex> lock(subscribersMtx);
+        return pruned;
+    }
+
+    void destroy() {
+        {
+            std::lock_guard<std::mutex> lock(jobsMtx);
+            destroyed = true;
+        }
+        jobsCv.notify_all();
+        for (auto &t : workers)
+            t.join();
+        workers.clear();
+        std::lock_guard<std::mutex> lock(subscribersMtx);
+        subscribers.clear();
+    }
+};
+typedef IceUtil::Handle<NotificationDispatcher> NotificationDispatcherPtr;
+
+// Hierarchical timer wheel for deadlines in epoch milliseconds. Level 0 has
+// `slots` buckets of tickMs each, every next level is `slots` times coarser.
+// An entry goes into the level its distance falls in and is moved one level
+// down when the wheel below wraps around to it, so scheduling is O(1) and
+// every entry is touched at most once per level before it fires. Entries
+// are list nodes spliced between slots and found by id, so cancelling one
+// is O(1) as well.
+class TimerWheel : public IceUtil::Shared {
+public:
+    typedef std::function<void()> Callback;
+
+private:
+    static const int slotBits = 6;
+    static const int slots = 1 << slotBits;
+    static const int levels = 4;
+
+    struct Entry {
+        Ice::Long id;
+        Ice::Long tick;
+        Callback callback;
+    };
+    typedef std::list<Entry> Slot;
+    struct Location {
+        Slot *slot;
+        Slot::iterator entry;
+    };
+
+    Ice::Long tickMs;
+    Ice::Long current;
+    Ice::Long nextId = 1;
+    Slot wheel[levels][slots];
+    std::unordered_map<Ice::Long, Location> locations;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool destroyed = false;
+    std::thread worker;
+
+    // moves the entry at it from `from` to the slot its tick falls in
+    void place(Slot &from, Slot::iterator it) {
+        Ice::Long delta = it->tick - current;
+        int level = 0;
+        while (level < levels - 1 && delta >= (Ice::Long(1) << (slotBits * (level + 1))))
+            level++;
+        // beyond the last level it waits in the farthest slot and is placed again
+        Ice::Long tick = std::min(it->tick, current + (Ice::Long(1) << (slotBits * levels)) - 1);
+        Slot &to = wheel[level][(tick >> (slotBits * level)) & (slots - 1)];
+        to.splice(to.end(), from, it);
+        locations[it->id] = Location{&to, it};
+    }
+
+    // moves the wheel to tick, collecting every callback due on the way
+    void advance(Ice::Long target, std::vector<Callback> &due) {
+        while (current < target) {
+            current++;
+            for (int level = 1; level < levels; level++) {
+                if ((current & ((Ice::Long(1) << (slotBits * level)) - 1)) != 0)
+                    break;
+                Slot cascade;
+                cascade.splice(cascade.end(), wheel[level][(current >> (slotBits * level)) & (slots - 1)]);
+                while (!cascade.empty())
+                    place(cascade, cascade.begin());
+            }
+            Slot slot;
+            slot.splice(slot.end(), wheel[0][current & (slots - 1)]);
+            while (!slot.empty()) {
+                auto it = slot.begin();
+                if (it->tick > current) {
+                    place(slot, it);
+                } else {
+                    locations.erase(it->id);
+                    due.push_back(it->callback);
+                    slot.erase(it);
+                }
+            }
+        }
+    }
+
+    // callbacks run without the lock, so they may schedule and cancel
+    void run() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!destroyed) {
+            cv.wait_for(lock, std::chrono::milliseconds(tickMs));
+            std::vector<Callback> due;
+            advance(nowMs() / tickMs, due);
+            if (due.empty())
+                continue;
+            lock.unlock();
+            for (const auto &callback : due)
+                callback();
+            lock.lock();
+        }
+    }
+
+public:
+    TimerWheel(int tick) : tickMs(std::max(tick, 1)), current(nowMs() / tickMs) {
+        worker = std::thread([this] { run(); });
+    }
+
+    // runs callback on the wheel thread within one tick after deadline,
+    // returns the id to cancel it with, 0 once the wheel is destroyed
+    Ice::Long schedule(Ice::Long deadline, const Callback &callback) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (destroyed)
+            return 0;
+        Ice::Long tick = (deadline + tickMs - 1) / tickMs;
+        Ice::Long id = nextId++;
+        Slot pending;
+        pending.push_back(Entry{id, std::max(tick, current + 1), callback});
+        place(pending, pending.begin());
+        return id;
+    }
+
+    // false when the entry already fired, is about to or was cancelled
+    bool cancel(Ice::Long id) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = locations.find(id);
+        if (it == locations.end())
+            return false;
+        it->second.slot->erase(it->second.entry);
+        locations.erase(it);
+        return true;
+    }
+
+    void destroy() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            destroyed = true;
+        }
+        cv.notify_all();
+        if (worker.joinable())
+            worker.join();
+        locations.clear();
+        for (auto &level : wheel)
+            for (auto &slot : level)
+                slot.clear();
+    }
+};
+typedef IceUtil::Handle<TimerWheel> TimerWheelPtr;
+
+// process wide notification state, set up by initServants()
+extern NotificationDispatcherPtr notifier;
+extern IceUtil::TimerPtr flushTimer;
+extern TimerWheelPtr expiryWheel;
+extern int defaultCoalesceWindowMs;
+
+void initServants(const Ice::CommunicatorPtr &ic);
+// shuts ic down and waits for its dispatches before the globals go away,
+// ic is the communicator whose adapters serve the stops (may be null)
+void destroyServants(const Ice::CommunicatorPtr &ic);
+
+// Upcoming arrivals at one stop: a time ordered multimap plus a hash from
+// tram identity to its node, so an update costs O(log n) and reading the
+// next k arrivals costs O(k).
+class ArrivalIndex {
+    typedef std::multimap<Ice::Long, TramInfo> ByTime;
+    ByTime byTime;
+    std::unordered_map<std::string, ByTime::iterator> byTram;
+
+public:
+    static std::string tramKey(const TramPrx &tram) {
+        Ice::Identity id = tram->ice_getIdentity();
+        return id.category + "/" + id.name;
+    }
+
+    const TramInfo *find(const std::string &key) const {
+        auto it = byTram.find(key);
+        return it == byTram.end() ? nullptr : &it->second->second;
+    }
+
+    void upsert(const TramInfo &info) {
+        std::string key = tramKey(info.tram);
+        auto it = byTram.find(key);
+        if (it != byTram.end()) {
+            byTime.erase(it->second);
+            it->second = byTime.emplace(info.time.ms, info);
+        } else {
+            byTram.emplace(key, byTime.emplace(info.time.ms, info));
+        }
+    }
+
+    bool erase(const TramPrx &tram) {
+        auto it = byTram.find(tramKey(tram));
+        if (it == byTram.end())
+            return false;
+        byTime.erase(it->second);
+        byTram.erase(it);
+        return true;
+    }
+
+    TramList first(int howMany) const {
+        TramList result;
+        if (howMany <= 0)
+            return result;
+        result.reserve(std::min(static_cast<size_t>(howMany), byTime.size()));
+        for (auto it = byTime.begin(); it != byTime.end() && static_cast<int>(result.size()) < howMany; ++it)
+            result.push_back(it->second);
+        return result;
+    }
+
+    TramList all() const {
+        return first(static_cast<int>(byTime.size()));
+    }
+
+    bool empty() const {
+        return byTime.empty();
+    }
+};
+
+class TramStopImpl : public TramStop {
+public:
+    typedef std::function<void(TramStopImpl*)> Action;
+    // runs the action on the resident servant of a stop, activating it first
+    // when asked to; false when it is not resident or not known
+    typedef std::function<bool(const std::string&, const Action&, bool)> Resident;
+
+private:
+    std::string name;
+    std::set<PassengerPrx> passengers;
+    SubscriberList subscribers = std::make_shared<std::vector<PassengerPrx>>();
+    // passengers following the stop through updateStopInfoBatch
+    std::set<PassengerPrx> batchPassengers;
+    SubscriberList batchSubscribers = std::make_shared<std::vector<PassengerPrx>>();
+    ArrivalIndex upcomingTrams;
+    Ice::Long seq = 0;
+    TramStopPrx selfProxy;
+    std::mutex mtx;
+
+    // arrivals stay on the board this long after their time has passed,
+    // then the expiry wheel removes them
+    static const Ice::Long departedGraceMs = 60 * 1000;
+
+    // changes since the last notification, keyed like the arrival index
+    int coalesceWindowMs;
+    bool flushScheduled = false;
+    std::map<std::string, TramPrx> changed;
+    std::map<std::string, TramPrx> removed;
+    NotifyStats stats = NotifyStats();
+
+    // stock numbers of trams that reported through UpdateTramInfo without one
+    std::unordered_map<std::string, std::string> stockNumbers;
+
+    // the last move applied per tram (ArrivalUpdate::move)
+    std::unordered_map<std::string, Ice::Long> moves;
+
+    // the expiry wheel entry of every arrival on the board, replaced when the
+    // arrival changes and cancelled while the stop is evicted
+    std::unordered_map<std::string, Ice::Long> expiries;
+
+    // passengers registered with a filter get their own view of the board
+    // instead of the deltas
+    struct Filtered {
+        SubscriptionFilter filter;
+        TramList lastSent;
+    };
+    std::map<PassengerPrx, Filtered> filtered;
+
+    // set for stops activated by an evictor
+    Resident resident;
+
+    // What timers and the dispatcher call back into. A stop managed by an
+    // evictor is looked up by name when the callback runs, so an evicted
+    // incarnation is neither kept alive nor run: its pending changes were
+    // flushed by saveState and the next one schedules its own expiries.
+    typedef std::function<void(const Action&)> Target;
+
+    Target target() {
+        if (resident) {
+            Resident r = resident;
+            std::string n = name;
+            return [r, n](const Action &action) { r(n, action, false); };
+        }
+        Ice::ObjectPtr self = this;
+        return [self](const Action &action) { action(dynamic_cast<TramStopImpl*>(self.get())); };
+    }
+
+    class FlushTask : public IceUtil::TimerTask {
+        Target stop;
+    public:
+        FlushTask(const Target &t) : stop(t) {}
+        virtual void runTimerTask() override {
+            stop([](TramStopImpl *s) { s->flush(); });
+        }
+    };
+    IceUtil::TimerTaskPtr flushTask;
+
+    void scheduleExpiry(const TramInfo &info) {
+        if (!expiryWheel)
+            return;
+        Target stop = target();
+        std::string key = ArrivalIndex::tramKey(info.tram);
+        Ice::Long arrival = info.time.ms;
+        Ice::Long &id = expiries[key];
+        if (id)
+            expiryWheel->cancel(id);
+        id = expiryWheel->schedule(arrival + departedGraceMs, [stop, key, arrival] {
+            stop([&](TramStopImpl *s) { s->expire(key, arrival); });
+        });
+    }
+
+    void cancelExpiries() {
+        if (expiryWheel) {
+            for (const auto &kv : expiries)
+                expiryWheel->cancel(kv.second);
+        }
+        expiries.clear();
+    }
+
+    NotificationDispatcher::DeadHandler deadHandler() {
+        Target stop = target();
+        return [stop](const PassengerPrx &p) {
+            stop([&](TramStopImpl *s) { s->subscriberDead(p); });
+        };
+    }
+
+    // sends the pending changes now or once the coalescing window closes
+    void changedLocked() {
+        if (coalesceWindowMs <= 0 || !flushTimer) {
+            flushLocked();
+        } else if (flushScheduled) {
+            // merged into the pending flush: one push less for every
+            // passenger, filtered ones included
+            stats.pushesSaved += subscribers->size() + batchSubscribers->size() + filtered.size();
+        } else {
+            flushScheduled = true;
+            flushTask = new FlushTask(target());
+            flushTimer->schedule(flushTask, IceUtil::Time::milliSeconds(coalesceWindowMs));
+        }
+    }
+
+    // the dispatcher walks an immutable copy, rebuilt only when passengers change
+    void publishSubscribers() {
+        subscribers = std::make_shared<std::vector<PassengerPrx>>(passengers.begin(), passengers.end());
+        batchSubscribers = std::make_shared<std::vector<PassengerPrx>>(batchPassengers.begin(), batchPassengers.end());
+    }
+
+    NotificationPtr encodeDelta(const TramList &upserts, const TramSeq &removals) {
+        Ice::OutputStreamPtr out = Ice::createOutputStream(notifier->communicator());
+        out->startEncapsulation();
+        out->write(selfProxy);
+        out->write(seq);
+        out->write(upserts);
+        out->write(removals);
+        out->endEncapsulation();
+
+        NotificationPtr n = new Notification;
+        n->operation = "updateStopDelta";
+        out->finished(n->params);
+        return n;
+    }
+
+    NotificationPtr encodeBoard(const TramList &upserts, const TramSeq &removals) {
+        StopBoard board;
+        board.stop = selfProxy;
+        board.seq = seq;
+        board.upserts = upserts;
+        board.removals = removals;
+
+        Ice::OutputStreamPtr out = Ice::createOutputStream(notifier->communicator());
+        out->startEncapsulation();
+        out->write(board);
+        out->endEncapsulation();
+
+        NotificationPtr n = new Notification;
+        n->operation = "updateStopInfoBatch";
+        n->element = true;
+        out->finished(n->params);
+        return n;
+    }
+
+    NotificationPtr encodeView(const TramList &view) {
+        Ice::OutputStreamPtr out = Ice::createOutputStream(notifier->communicator());
+        out->startEncapsulation();
+        out->write(selfProxy);
+        out->write(view);
+        out->endEncapsulation();
+
+        NotificationPtr n = new Notification;
+        n->operation = "updateStopInfo";
+        out->finished(n->params);
+        return n;
+    }
+
+    // sends p its view when it differs enough from the last one sent
+    void sendViewLocked(const PassengerPrx &p, Filtered &f, const TramList &board, Ice::Long now) {
+        TramList view = filterBoard(board, f.filter, now);
+        if (!changedMaterially(f.lastSent, view, f.filter.minChangeMs)) {
+            stats.pushesSaved++;
+            return;
+        }
+        f.lastSent = view;
+        notifier->post(std::make_shared<std::vector<PassengerPrx>>(1, p), encodeView(view), this, deadHandler());
+        stats.pushesSent++;
+    }
+
+    void flushLocked() {
+        if (changed.empty() && removed.empty())
+            return;
+
+        TramList upserts;
+        for (const auto &kv : changed) {
+            const TramInfo *info = upcomingTrams.find(kv.first);
+            if (info)
+                upserts.push_back(*info);
+        }
+        TramSeq removals;
+        for (const auto &kv : removed)
+            removals.push_back(kv.second);
+        changed.clear();
+        removed.clear();
+        seq++;
+
+        if (passengers.empty() && batchPassengers.empty() && filtered.empty())
+            return;
+        if (!selfProxy) {
+            std::cerr << "Cannot notify passengers: selfProxy not set for stop " << name << std::endl;
+            return;
+        }
+        stats.flushes++;
+        NotificationDispatcher::DeadHandler onDead = deadHandler();
+        if (!passengers.empty()) {
+            notifier->post(subscribers, encodeDelta(upserts, removals), this, onDead);
+            stats.pushesSent += subscribers->size();
+        }
+        if (!batchPassengers.empty()) {
+            notifier->post(batchSubscribers, encodeBoard(upserts, removals), this, onDead);
+            stats.pushesSent += batchSubscribers->size();
+        }
+        if (!filtered.empty()) {
+            TramList board = upcomingTrams.all();
+            Ice::Long now = nowMs();
+            for (auto &kv : filtered)
+                sendViewLocked(kv.first, kv.second, board, now);
+        }
+    }
+
+public:
+    TramStopImpl(const std::string &n) : name(n), coalesceWindowMs(defaultCoalesceWindowMs) {}
+
+    void setSelfProxy(const TramStopPrx &proxy) {
+        std::lock_guard<std::mutex> lock(mtx);
+        selfProxy = proxy;
+    }
+
+    void setResident(const Resident &r) {
+        std::lock_guard<std::mutex> lock(mtx);
+        resident = r;
+    }
+
+    // what the evictor keeps for a stop that is not resident
+    struct State {
+        std::set<PassengerPrx> passengers;
+        std::set<PassengerPrx> batchPassengers;
+        TramList board;
+        Ice::Long seq = 0;
+        int coalesceWindowMs = 0;
+        std::unordered_map<std::string, std::string> stockNumbers;
+        std::unordered_map<std::string, Ice::Long> moves;
+        std::map<PassengerPrx, Filtered> filtered;
+    };
+
+    // pending changes are sent first, so the saved board matches seq
+    State saveState() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (flushTask && flushTimer)
+            flushTimer->cancel(flushTask);
+        flushTask = 0;
+        flushScheduled = false;
+        flushLocked();
+        cancelExpiries();
+        State state;
+        state.passengers = passengers;
+        state.batchPassengers = batchPassengers;
+        state.board = upcomingTrams.all();
+        state.seq = seq;
+        state.coalesceWindowMs = coalesceWindowMs;
+        state.stockNumbers = stockNumbers;
+        state.moves = moves;
+        state.filtered = filtered;
+        return state;
+    }
+
+    void restoreState(const State &state) {
+        std::lock_guard<std::mutex> lock(mtx);
+        passengers = state.passengers;
+        batchPassengers = state.batchPassengers;
+        publishSubscribers();
+        for (const auto &info : state.board) {
+            upcomingTrams.upsert(info);
+            scheduleExpiry(info);
+        }
+        seq = state.seq;
+        coalesceWindowMs = state.coalesceWindowMs;
+        stockNumbers = state.stockNumbers;
+        moves = state.moves;
+        filtered = state.filtered;
+    }
+
+    // changes arriving within the window are merged into one notification,
+    // 0 sends every change on its own
+    void setCoalesceWindow(int ms) {
+        std::lock_guard<std::mutex> lock(mtx);
+        coalesceWindowMs = std::max(ms, 0);
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(mtx);
+        flushTask = 0;
+        flushScheduled = false;
+        flushLocked();
+    }
+
+    virtual std::string getName(const Ice::Current& = Ice::Current()) override {
+        return name;
+    }
+
+    virtual TramList getNextTrams(int howMany, const Ice::Current& = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        return upcomingTrams.first(howMany);
+    }
+
+    virtual TramList getBoard(Ice::Long &boardSeq, const Ice::Current& = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        boardSeq = seq;
+        return upcomingTrams.all();
+    }
+
+    virtual NotifyStats getNotifyStats(const Ice::Current& = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        return stats;
+    }
+
+    // passengers take their baseline from getBoard and then follow the deltas
+    virtual void RegisterPassenger(const PassengerPrx &p, const Ice::Current &current = Ice::Current()) override {
+        PassengerPrx passenger = callbackProxy(p, current);
+        if (notifier)
+            notifier->revive(passenger);
+        std::lock_guard<std::mutex> lock(mtx);
+        filtered.erase(passenger);
+        batchPassengers.erase(passenger);
+        passengers.insert(passenger);
+        publishSubscribers();
+        std::cout << "passenger registered at stop " << name << std::endl;
+    }
+
+    // like RegisterPassenger, the changes are sent as StopBoard elements
+    void registerBatched(const PassengerPrx &passenger) {
+        if (notifier)
+            notifier->revive(passenger);
+        std::lock_guard<std::mutex> lock(mtx);
+        filtered.erase(passenger);
+        passengers.erase(passenger);
+        batchPassengers.insert(passenger);
+        publishSubscribers();
+        std::cout << "passenger registered at stop " << name << " for batches" << std::endl;
+    }
+
+    void unregister(const PassengerPrx &passenger) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            size_t erased = passengers.erase(passenger) + batchPassengers.erase(passenger);
+            if (erased)
+                publishSubscribers();
+            filtered.erase(passenger);
+        }
+        if (notifier)
+            notifier->release(this, passenger);
+        std::cout << "passenger unregistered at stop " << name << std::endl;
+    }
+
+    // the current view is sent right away, later only material changes
+    virtual void RegisterPassengerFiltered(const PassengerPrx &p, const SubscriptionFilter &filter, const Ice::Current &current = Ice::Current()) override {
+        PassengerPrx passenger = callbackProxy(p, current);
+        if (notifier)
+            notifier->revive(passenger);
+        std::lock_guard<std::mutex> lock(mtx);
+        if (passengers.erase(passenger) + batchPassengers.erase(passenger))
+            publishSubscribers();
+        Filtered &f = filtered[passenger];
+        f.filter = filter;
+        f.lastSent.clear();
+        if (selfProxy && notifier)
+            sendViewLocked(passenger, f, upcomingTrams.all(), nowMs());
+        std::cout << "passenger registered at stop " << name << " with a filter" << std::endl;
+    }
+
+    virtual void UnregisterPassenger(const PassengerPrx &p, const Ice::Current &current = Ice::Current()) override {
+        unregister(callbackProxy(p, current));
+    }
+
+    // called by the dispatcher once notifications to p keep failing
+    void subscriberDead(const PassengerPrx &p) {
+        std::lock_guard<std::mutex> lock(mtx);
+        size_t erased = filtered.erase(p) + batchPassengers.erase(p);
+        if (!passengers.erase(p) && !erased)
+            return;
+        publishSubscribers();
+        stats.pruned++;
+        std::cout << "passenger " << p->ice_getIdentity().name << " dropped at stop " << name << std::endl;
+    }
+
+    virtual void UpdateTramInfo(const TramPrx &tram, const Timestamp& time, const Ice::Current& = Ice::Current()) override {
+        std::string key = ArrivalIndex::tramKey(tram);
+        std::string stockNumber;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = stockNumbers.find(key);
+            if (it != stockNumbers.end())
+                stockNumber = it->second;
+        }
+        if (stockNumber.empty()) {
+            stockNumber = tram->getStockNumber();
+            std::lock_guard<std::mutex> lock(mtx);
+            stockNumbers[key] = stockNumber;
+        }
+        updateArrival(tram, stockNumber, std::string(), time);
+    }
+
+    // an empty line keeps the one the tram reported before; an update of an
+    // older move than the last applied one arrived late and is dropped
+    void updateArrival(const TramPrx &tram, const std::string &stockNumber, const std::string &line, const Timestamp &time,
+                       Ice::Long move = 0) {
+        TramInfo info;
+        info.time = time;
+        info.tram = tram;
+        info.stockNumber = stockNumber;
+        info.line = line;
+
+        std::string key = ArrivalIndex::tramKey(tram);
+        std::lock_guard<std::mutex> lock(mtx);
+        if (move > 0) {
+            Ice::Long &last = moves[key];
+            if (move < last)
+                return;
+            last = move;
+        }
+        if (info.line.empty()) {
+            const TramInfo *previous = upcomingTrams.find(key);
+            if (previous)
+                info.line = previous->line;
+        }
+        upcomingTrams.upsert(info);
+        stockNumbers[key] = stockNumber;
+        changed[key] = tram;
+        removed.erase(key);
+        stats.updates++;
+        scheduleExpiry(info);
+        changedLocked();
+    }
+
+    // called by the expiry wheel; updating an arrival cancels its entry, one
+    // that was already due when it changed finds a different time and stays
+    void expire(const std::string &key, Ice::Long arrival) {
+        std::lock_guard<std::mutex> lock(mtx);
+        const TramInfo *info = upcomingTrams.find(key);
+        if (!info || info->time.ms != arrival)
+            return;
+        TramPrx tram = info->tram;
+        upcomingTrams.erase(tram);
+        expiries.erase(key);
+        changed.erase(key);
+        removed[key] = tram;
+        changedLocked();
+    }
+
+    // Runs action on stop when it is served in this process: this servant,
+    // a resident one of the same evictor (an evicted one when activate is
+    // set) or one added to the adapter. False when stop has to be called; a
+    // forward to an evicted stop activates it and arrives with its own
+    // identity, so it is never sent back here.
+    bool withLocal(const TramStopPrx &stop, const Ice::Current &current, const Action &action, bool activate = false) {
+        Ice::Identity id = stop->ice_getIdentity();
+        if (id == current.id) {
+            action(this);
+            return true;
+        }
+        Resident r;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            r = resident;
+        }
+        if (r && id.category.empty() && r(id.name, action, activate))
+            return true;
+        Ice::ObjectPtr servant;
+        if (current.adapter)
+            servant = current.adapter->find(id);
+        TramStopImpl *local = dynamic_cast<TramStopImpl*>(servant.get());
+        if (!local)
+            return false;
+        action(local);
+        return true;
+    }
+
+    // Entries for servants of this process are applied in-process, the rest
+    // is forwarded oneway with one batch per server. Evicted stops of this
+    // process get their entry on its own, it activates them on arrival.
+    virtual void UpdateTramInfoBatch(const ArrivalList &updates, const Ice::Current &current = Ice::Current()) override {
+        std::string self;
+        if (current.adapter)
+            self = serverKey(current.adapter->createProxy(current.id));
+        std::map<std::string, ArrivalList> byServer;
+        for (const auto &u : updates) {
+            if (!u.stop)
+                continue;
+            bool local = withLocal(u.stop, current, [&](TramStopImpl *s) {
+                s->updateArrival(u.tram, u.stockNumber, u.line, u.time, u.move);
+            });
+            if (local)
+                continue;
+            std::string server = serverKey(u.stop);
+            if (server == self)
+                TramStopPrx::uncheckedCast(u.stop->ice_oneway())->begin_UpdateTramInfoBatch(ArrivalList(1, u));
+            else
+                byServer[server].push_back(u);
+        }
+        for (const auto &kv : byServer) {
+            try {
+                TramStopPrx::uncheckedCast(kv.second.front().stop->ice_oneway())->begin_UpdateTramInfoBatch(kv.second);
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "cant forward arrivals to " << kv.first << ": " << ex << std::endl;
+            }
+        }
+    }
+
+    // Stops of this process are registered in-process, evicted ones are
+    // activated for it, so nothing waits on a nested call. Stops of other
+    // servers get one oneway batch per server; a bidirectional passenger
+    // can only be reached over its own connection and is not forwarded.
+    void forEachStop(const StopSeq &stops, const PassengerPrx &passenger, const Ice::Current &current, const Action &action,
+                     const std::function<void(const TramStopPrx&, const StopSeq&)> &forward) {
+        std::map<std::string, StopSeq> byServer;
+        for (const auto &stop : stops) {
+            if (!stop || withLocal(stop, current, action, true))
+                continue;
+            if (passenger->ice_getEndpoints().empty() && passenger->ice_getAdapterId().empty()) {
+                std::cerr << "cant forward bidir passenger " << passenger->ice_getIdentity().name
+                          << " to stop " << stop->ice_getIdentity().name << std::endl;
+                continue;
+            }
+            byServer[serverKey(stop)].push_back(stop);
+        }
+        for (const auto &kv : byServer) {
+            try {
+                forward(TramStopPrx::uncheckedCast(kv.second.front()->ice_oneway()), kv.second);
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "cant forward passenger to " << kv.first << ": " << ex << std::endl;
+            }
+        }
+    }
+
+    virtual void RegisterPassengerBatch(const StopSeq &stops, const PassengerPrx &p, const Ice::Current &current = Ice::Current()) override {
+        PassengerPrx passenger = callbackProxy(p, current);
+        forEachStop(stops, passenger, current, [&](TramStopImpl *s) { s->registerBatched(passenger); },
+                    [&](const TramStopPrx &target, const StopSeq &group) { target->begin_RegisterPassengerBatch(group, passenger); });
+    }
+
+    virtual void UnregisterPassengerBatch(const StopSeq &stops, const PassengerPrx &p, const Ice::Current &current = Ice::Current()) override {
+        PassengerPrx passenger = callbackProxy(p, current);
+        forEachStop(stops, passenger, current, [&](TramStopImpl *s) { s->unregister(passenger); },
+                    [&](const TramStopPrx &target, const StopSeq &group) { target->begin_UnregisterPassengerBatch(group, passenger); });
+    }
+};
+
+inline Ice::ObjectPtr createTramStopImpl(const std::string &name) {
+    return new TramStopImpl(name);
+}
+
+// Servant locator that activates servants on first use and keeps at most
+// `capacity` of them resident. When the cache is full the least recently
+// used servant that is not dispatching is saved (Servant::saveState) and
+// dropped; it is recreated from that state on its next request. States the
+// keep predicate rejects are not held (the creator rebuilds them), and at
+// most `savedCapacity` are, the oldest going first. Only names added
+// through add() are activated, anything else is ObjectNotExist.
+template<class Servant>
+class Evictor : public Ice::ServantLocator {
+public:
+    typedef std::function<Servant*(const Ice::Identity&)> Creator;
+    typedef std::function<bool(const typename Servant::State&)> Keep;
+
+private:
+    struct Entry {
+        Ice::ObjectPtr servant;
+        std::list<std::string>::iterator position;
+        int inUse = 0;
+    };
+
+    struct Saved {
+        typename Servant::State state;
+        std::list<std::string>::iterator position;
+    };
+
+    Creator create;
+    Keep keep;
+    size_t capacity;
+    size_t savedCapacity;
+    std::mutex mtx;
+    std::set<std::string> known;
+    std::unordered_map<std::string, Entry> resident;
+    std::list<std::string> lru;
+    std::unordered_map<std::string, Saved> saved;
+    // newest first
+    std::list<std::string> savedOrder;
+    CacheStats stats = CacheStats();
+
+    void save(const std::string &name, const Ice::ObjectPtr &servant) {
+        typename Servant::State state = dynamic_cast<Servant*>(servant.get())->saveState();
+        if (keep && !keep(state))
+            return;
+        auto old = saved.find(name);
+        if (old != saved.end())
+            savedOrder.erase(old->second.position);
+        savedOrder.push_front(name);
+        Saved &entry = saved[name];
+        entry.state = state;
+        entry.position = savedOrder.begin();
+        while (saved.size() > savedCapacity) {
+            saved.erase(savedOrder.back());
+            savedOrder.pop_back();
+        }
+    }
+
+    void release(const std::string &name) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = resident.find(name);
+        if (it != resident.end())
+            it->second.inUse--;
+        evictIdle();
+    }
+
+    void evictIdle() {
+        auto it = lru.end();
+        while (resident.size() > capacity && it != lru.begin()) {
+            --it;
+            auto entry = resident.find(*it);
+            if (entry->second.inUse > 0)
+                continue;
+            save(*it, entry->second.servant);
+            resident.erase(entry);
+            it = lru.erase(it);
+            stats.evictions++;
+        }
+    }
+
+    // creates the servant of a known name from its saved state, pinned like
+    // a dispatch; null for names that were never added
+    Ice::ObjectPtr activateLocked(const Ice::Identity &id) {
+        const std::string &name = id.name;
+        if (!known.count(name))
+            return 0;
+
+        stats.misses++;
+        Servant *servant = create(id);
+        auto state = saved.find(name);
+        if (state != saved.end()) {
+            servant->restoreState(state->second.state);
+            savedOrder.erase(state->second.position);
+            saved.erase(state);
+        }
+
+        lru.push_front(name);
+        Entry &entry = resident[name];
+        entry.servant = servant;
+        entry.position = lru.begin();
+        entry.inUse = 1;
+        evictIdle();
+        return entry.servant;
+    }
+
+public:
+    Evictor(const Creator &c, size_t cap, const Keep &k = Keep(), size_t savedCap = 100000)
+            : create(c), keep(k), capacity(std::max<size_t>(cap, 1)), savedCapacity(savedCap) {}
+
+    void add(const std::string &name) {
+        std::lock_guard<std::mutex> lock(mtx);
+        known.insert(name);
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return known.size();
+    }
+
+    CacheStats getStats() {
+        std::lock_guard<std::mutex> lock(mtx);
+        CacheStats result = stats;
+        result.resident = static_cast<int>(resident.size());
+        return result;
+    }
+
+    // runs f on the servant called name if it is resident, pinned like a
+    // dispatch so it is not evicted meanwhile; false when it is not resident.
+    // With activate an evicted servant is brought back like on a request.
+    bool withResident(const std::string &name, const std::function<void(Servant*)> &f, bool activate = false) {
+        Ice::ObjectPtr servant;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = resident.find(name);
+            if (it != resident.end()) {
+                it->second.inUse++;
+                servant = it->second.servant;
+            } else if (activate) {
+                Ice::Identity id;
+                id.name = name;
+                servant = activateLocked(id);
+            }
+            if (!servant)
+                return false;
+        }
+        try {
+            f(dynamic_cast<Servant*>(servant.get()));
+        } catch (...) {
+            release(name);
+            throw;
+        }
+        release(name);
+        return true;
+    }
+
+    virtual Ice::ObjectPtr locate(const Ice::Current &current, Ice::LocalObjectPtr &) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = resident.find(current.id.name);
+        if (it != resident.end()) {
+            stats.hits++;
+            lru.splice(lru.begin(), lru, it->second.position);
+            it->second.inUse++;
+            return it->second.servant;
+        }
+        return activateLocked(current.id);
+    }
+
+    virtual void finished(const Ice::Current &current, const Ice::ObjectPtr &, const Ice::LocalObjectPtr &) override {
+        release(current.id.name);
+    }
+
+    virtual void deactivate(const std::string &) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto &kv : resident)
+            save(kv.first, kv.second.servant);
+        resident.clear();
+        lru.clear();
+    }
+};
+
+class LineFactoryImpl : public LineFactory {
+    Ice::ObjectAdapterPtr adapter;
+    IceUtil::Handle<Evictor<LineImpl>> evictor;
+    StorePtr store;
+
+public:
+    // lines are activated on first use by an evictor registered on the adapter,
+    // with a store they start from their persisted state and the evictor
+    // keeps nothing for them
+    LineFactoryImpl(const Ice::ObjectAdapterPtr& adapter, const MPKPrx& mpk, const StorePtr& s = 0) : adapter(adapter), store(s) {
+        StorePtr st = s;
+        Ice::PropertiesPtr props = adapter->getCommunicator()->getProperties();
+        evictor = new Evictor<LineImpl>(
+                [mpk, st](const Ice::Identity &id) {
+                    LineImpl *line = new LineImpl(id.name, mpk, st);
+                    LineState state;
+                    if (st && st->read("linestate/" + id.name, state))
+                        line->restoreState(state);
+                    return line;
+                },
+                props->getPropertyAsIntWithDefault("MPK.Evictor.Capacity", 10000),
+                [st](const LineState &) { return !st; },
+                props->getPropertyAsIntWithDefault("MPK.Evictor.SavedCapacity", 100000));
+        if (store) {
+            for (const auto &kv : store->scan("lines/"))
+                evictor->add(kv.first);
+        }
+        adapter->addServantLocator(evictor, "");
+    }
+
+    virtual LinePrx createLine(const std::string& name, const Ice::Current&) override {
+        evictor->add(name);
+        if (store)
+            store->put("lines/" + name);
+        return LinePrx::uncheckedCast(adapter->createProxy(Ice::stringToIdentity(name)));
+    }
+
+    virtual LineList createLines(const NameList& names, const Ice::Current& current) override {
+        LineList lines;
+        lines.reserve(names.size());
+        for (const auto &name : names)
+            lines.push_back(createLine(name, current));
+        return lines;
+    }
+
+    virtual double getLoad(const Ice::Current&) override {
+        return static_cast<double>(evictor->size());
+    }
+
+    virtual CacheStats getCacheStats(const Ice::Current&) override {
+        return evictor->getStats();
+    }
+};
+
+class StopFactoryImpl : public StopFactory {
+    Ice::ObjectAdapterPtr adapter;
+    IceUtil::Handle<Evictor<TramStopImpl>> evictor;
+    StorePtr store;
+
+public:
+    // stops are activated on first use by an evictor registered on the adapter;
+    // only their names are persisted, boards and subscribers are rebuilt live
+    StopFactoryImpl(const Ice::ObjectAdapterPtr& adapter, const StorePtr& s = 0) : adapter(adapter), store(s) {
+        Ice::ObjectAdapterPtr a = adapter;
+        // stops find their resident neighbours through the evictor, by raw
+        // pointer since the stops it keeps must not keep it alive in turn
+        StopFactoryImpl *factory = this;
+        Ice::PropertiesPtr props = adapter->getCommunicator()->getProperties();
+        evictor = new Evictor<TramStopImpl>(
+                [a, factory](const Ice::Identity &id) {
+                    TramStopImpl *stop = new TramStopImpl(id.name);
+                    stop->setSelfProxy(TramStopPrx::uncheckedCast(a->createProxy(id)));
+                    Evictor<TramStopImpl> *e = factory->evictor.get();
+                    stop->setResident([e](const std::string &name, const TramStopImpl::Action &action, bool activate) {
+                        return e->withResident(name, action, activate);
+                    });
+                    return stop;
+                },
+                props->getPropertyAsIntWithDefault("MPK.Evictor.Capacity", 10000),
+                // a stop nobody follows and no tram is heading to starts over empty
+                [](const TramStopImpl::State &state) {
+                    return !state.board.empty() || !state.passengers.empty()
+                           || !state.batchPassengers.empty() || !state.filtered.empty()
+                           || state.coalesceWindowMs != defaultCoalesceWindowMs;
+                },
+                props->getPropertyAsIntWithDefault("MPK.Evictor.SavedCapacity", 100000));
+        if (store) {
+            for (const auto &kv : store->scan("stops/"))
+                evictor->add(kv.first);
+        }
+        adapter->addServantLocator(evictor, "");
+    }
+
+    virtual TramStopPrx createStop(const std::string& name, const Ice::Current&) override {
+        evictor->add(name);
+        if (store)
+            store->put("stops/" + name);
+        return TramStopPrx::uncheckedCast(adapter->createProxy(Ice::stringToIdentity(name)));
+    }
+
+    virtual StopSeq createStops(const NameList& names, const Ice::Current& current) override {
+        StopSeq stops;
+        stops.reserve(names.size());
+        for (const auto &name : names)
+            stops.push_back(createStop(name, current));
+        return stops;
+    }
+
+    virtual double getLoad(const Ice::Current&) override {
+        return static_cast<double>(evictor->size());
+    }
+
+    virtual CacheStats getCacheStats(const Ice::Current&) override {
+        return evictor->getStats();
+    }
+};
+
+#endif
@@ -0,0 +1,301 @@
+#include <Store.h>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// record: u32 payload size, u32 checksum of payload, payload
+// payload: u8 op, u32 key size, key, value
+static const Ice::Byte opPut = 1;
+static const Ice::Byte opErase = 2;
+static const char snapshotMagic[4] = {'M', 'P', 'K', 'S'};
+
+static uint32_t checksum(const Ice::Byte *p, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void encodeRecord(vector<Ice::Byte> &buf, Ice::Byte op, const string &key, const vector<Ice::Byte> &value) {
+    uint32_t keySize = static_cast<uint32_t>(key.size());
+    uint32_t size = static_cast<uint32_t>(1 + sizeof(keySize) + key.size() + value.size());
+    size_t start = buf.size();
+    buf.resize(start + 2 * sizeof(uint32_t) + size);
+
+    Ice::Byte *p = &buf[start] + 2 * sizeof(uint32_t);
+    p[0] = op;
+    memcpy(p + 1, &keySize, sizeof(keySize));
+    memcpy(p + 1 + sizeof(keySize), key.data(), key.size());
+    if (!value.empty())
+        memcpy(p + 1 + sizeof(keySize) + key.size(), &value[0], value.size());
+
+    uint32_t sum = checksum(p, size);
+    memcpy(&buf[start], &size, sizeof(size));
+    memcpy(&buf[start] + sizeof(size), &sum, sizeof(sum));
+}
+
+static void writeFully(int fd, const vector<Ice::Byte> &buf) {
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t n = ::write(fd, &buf[done], buf.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw runtime_error("store write failed: " + string(strerror(errno)));
+        done += static_cast<size_t>(n);
+    }
+}
+
+// writes buf to path atomically: a temporary file that is synced and renamed
+// over path, then the directory is synced so the rename is durable
+static void replaceFile(const string &dir, const string &path, const vector<Ice::Byte> &buf) {
+    string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw runtime_error("cant create " + tmp);
+    try {
+        writeFully(fd, buf);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    fsync(fd);
+    ::close(fd);
+    if (rename(tmp.c_str(), path.c_str()) < 0)
+        throw runtime_error("cant replace " + path);
+    int dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirFd < 0)
+        throw runtime_error("cant open " + dir);
+    fsync(dirFd);
+    ::close(dirFd);
+}
+
+// the timer is destroyed by ~Store before the store goes away
+class SnapshotTask : public IceUtil::TimerTask {
+    Store *store;
+public:
+    SnapshotTask(Store *s) : store(s) {}
+    virtual void runTimerTask() override {
+        try {
+            store->snapshot();
+        } catch (const exception &ex) {
+            cerr << "snapshot failed: " << ex.what() << endl;
+        }
+    }
+};
+
+Store::Store(const Ice::CommunicatorPtr &communicator, const string &d) : ic(communicator), dir(d) {
+    Ice::PropertiesPtr props = ic->getProperties();
+    syncWrites = props->getPropertyAsIntWithDefault("MPK.Store.Sync", 0) > 0;
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+        throw runtime_error("cant create store directory " + dir);
+
+    load(dir + "/snapshot", false);
+    load(dir + "/wal", true);
+
+    logFd = ::open((dir + "/wal").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (logFd < 0)
+        throw runtime_error("cant open " + dir + "/wal");
+
+    int snapshotMs = props->getPropertyAsIntWithDefault("MPK.Store.SnapshotMs", 60000);
+    if (snapshotMs > 0) {
+        timer = new IceUtil::Timer();
+        timer->scheduleRepeated(new SnapshotTask(this), IceUtil::Time::milliSeconds(snapshotMs));
+    }
+}
+
+Store::~Store() {
+    if (timer)
+        timer->destroy();
+    if (logFd >= 0)
+        ::close(logFd);
+}
+
+// a log is read up to its first bad record and truncated there, the snapshot
+// is written atomically so it is either complete or missing
+void Store::load(const string &path, bool log) {
+    int fd = ::open(path.c_str(), log ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        ::close(fd);
+        return;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void *mapped = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        ::close(fd);
+        throw runtime_error("cant map " + path);
+    }
+
+    const Ice::Byte *base = static_cast<const Ice::Byte*>(mapped);
+    size_t pos = 0;
+    if (!log) {
+        if (size < sizeof(snapshotMagic) || memcmp(base, snapshotMagic, sizeof(snapshotMagic)) != 0) {
+            munmap(mapped, size);
+            ::close(fd);
+            throw runtime_error(path + " is not a snapshot");
+        }
+        pos = sizeof(snapshotMagic);
+    }
+
+    while (pos + 2 * sizeof(uint32_t) <= size) {
+        uint32_t recordSize, sum;
+        memcpy(&recordSize, base + pos, sizeof(recordSize));
+        memcpy(&sum, base + pos + sizeof(recordSize), sizeof(sum));
+        const Ice::Byte *p = base + pos + 2 * sizeof(uint32_t);
+        if (recordSize < 1 + sizeof(uint32_t) || p + recordSize > base + size || checksum(p, recordSize) != sum)
+            break;
+
+        uint32_t keySize;
+        memcpy(&keySize, p + 1, sizeof(keySize));
+        if (1 + sizeof(keySize) + keySize > recordSize)
+            break;
+        string key(reinterpret_cast<const char*>(p + 1 + sizeof(keySize)), keySize);
+        if (p[0] == opPut) {
+            const Ice::Byte *value = p + 1 + sizeof(keySize) + keySize;
+            data[key].assign(value, p + recordSize);
+        } else {
+            data.erase(key);
+        }
+        pos += 2 * sizeof(uint32_t) + recordSize;
+    }
+    munmap(mapped, size);
+
+    if (log) {
+        if (pos < size) {
+            cerr << "store: dropping " << size - pos << " bytes of torn log in " << path << endl;
+            if (ftruncate(fd, static_cast<off_t>(pos)) < 0)
+                cerr << "store: cant truncate " << path << endl;
+        }
+        logBytes = pos;
+    }
+    ::close(fd);
+}
+
+void Store::append(Ice::Byte op, const string &key, const vector<Ice::Byte> &value) {
+    if (logFd < 0)
+        return;
+    vector<Ice::Byte> record;
+    encodeRecord(record, op, key, value);
+    writeFully(logFd, record);
+    if (syncWrites)
+        fdatasync(logFd);
+    logBytes += record.size();
+}
+
+void Store::put(const string &key, const vector<Ice::Byte> &value) {
+    lock_guard<mutex> lock(mtx);
+    append(opPut, key, value);
+    data[key] = value;
+}
+
+void Store::erase(const string &key) {
+    lock_guard<mutex> lock(mtx);
+    if (data.erase(key))
+        append(opErase, key, vector<Ice::Byte>());
+}
+
+bool Store::get(const string &key, vector<Ice::Byte> &value) {
+    lock_guard<mutex> lock(mtx);
+    auto it = data.find(key);
+    if (it == data.end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+map<string, vector<Ice::Byte>> Store::scan(const string &prefix) {
+    lock_guard<mutex> lock(mtx);
+    map<string, vector<Ice::Byte>> result;
+    for (auto it = data.lower_bound(prefix); it != data.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+        result[it->first.substr(prefix.size())] = it->second;
+    return result;
+}
+
+// The map is copied under mtx and written outside of it, so puts go on
+// while the snapshot is encoded and synced. Records appended meanwhile are
+// not in the snapshot, they are kept as the new log.
+void Store::snapshot() {
+    lock_guard<mutex> snapshotLock(snapshotMtx);
+    map<string, Bytes> copy;
+    size_t covered;
+    {
+        lock_guard<mutex> lock(mtx);
+        if (logFd < 0 || logBytes == 0)
+            return;
+        copy = data;
+        covered = logBytes;
+    }
+
+    vector<Ice::Byte> buf(snapshotMagic, snapshotMagic + sizeof(snapshotMagic));
+    for (const auto &kv : copy)
+        encodeRecord(buf, opPut, kv.first, kv.second);
+    copy.clear();
+    // the snapshot has to be durable before the log it replaces is cut
+    replaceFile(dir, dir + "/snapshot", buf);
+
+    lock_guard<mutex> lock(mtx);
+    if (logFd < 0)
+        return;
+    if (logBytes == covered) {
+        // everything in the log is in the snapshot now
+        if (ftruncate(logFd, 0) < 0)
+            throw runtime_error("cant truncate log in " + dir);
+        logBytes = 0;
+        return;
+    }
+
+    // replaying the whole log over the snapshot gives the same map, so a
+    // crash before the rename loses nothing
+    vector<Ice::Byte> tail(logBytes - covered);
+    size_t done = 0;
+    while (done < tail.size()) {
+        ssize_t n = pread(logFd, &tail[done], tail.size() - done, static_cast<off_t>(covered + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw runtime_error("cant read log in " + dir);
+        done += static_cast<size_t>(n);
+    }
+    replaceFile(dir, dir + "/wal", tail);
+    int fd = ::open((dir + "/wal").c_str(), O_WRONLY | O_APPEND);
+    if (fd < 0)
+        throw runtime_error("cant open " + dir + "/wal");
+    ::close(logFd);
+    logFd = fd;
+    logBytes = tail.size();
+}
+
+void Store::close() {
+    if (timer) {
+        timer->destroy();
+        timer = 0;
+    }
+    try {
+        snapshot();
+    } catch (const exception &ex) {
+        cerr << "snapshot failed: " << ex.what() << endl;
+    }
+    lock_guard<mutex> lock(mtx);
+    if (logFd >= 0) {
+        ::close(logFd);
+        logFd = -1;
+    }
+}
+
+StorePtr openStore(const Ice::CommunicatorPtr &ic, const string &dir) {
+    if (dir.empty())
+        return 0;
+    return new Store(ic, dir);
+}
@@ -0,0 +1,103 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <Ice/Ice.h>
+#include <IceUtil/Timer.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Key/value store for the registry and line state. Every change is appended
+// to a write-ahead log (wal) as a checksummed record; the whole map is
+// periodically written to a snapshot (snapshot) and the log truncated. On
+// open the snapshot is memory-mapped and the log replayed on top of it, a
+// torn record at the end of the log is cut off.
+//
+// Values are Ice-encoded, so any Slice type or proxy can be stored with
+// write()/read().
+
+
+class Store : public IceUtil::Shared {
+    typedef std::vector<Ice::Byte> Bytes;
+
+    Ice::CommunicatorPtr ic;
+    std::string dir;
+    int logFd = -1;
+    size_t logBytes = 0;
+    bool syncWrites;
+    std::map<std::string, Bytes> data;
+    std::mutex mtx;
+    // one snapshot at a time, taken before mtx
+    std::mutex snapshotMtx;
+    IceUtil::TimerPtr timer;
+
+    void load(const std::string &path, bool log);
+    void append(Ice::Byte op, const std::string &key, const Bytes &value);
+
+    template<class T>
+    static void writeAll(const Ice::OutputStreamPtr &out, const T &value) {
+        out->write(value);
+    }
+    template<class T, class... Rest>
+    static void writeAll(const Ice::OutputStreamPtr &out, const T &value, const Rest&... rest) {
+        out->write(value);
+        writeAll(out, rest...);
+    }
+    template<class T>
+    static void readAll(const Ice::InputStreamPtr &in, T &value) {
+        in->read(value);
+    }
+    template<class T, class... Rest>
+    static void readAll(const Ice::InputStreamPtr &in, T &value, Rest&... rest) {
+        in->read(value);
+        readAll(in, rest...);
+    }
+
+public:
+    // MPK.Store.Sync=1 fsyncs the log after every record, MPK.Store.SnapshotMs
+    // is the compaction period (0 disables it)
+    Store(const Ice::CommunicatorPtr &ic, const std::string &dir);
+    ~Store();
+
+    void put(const std::string &key, const Bytes &value = Bytes());
+    void erase(const std::string &key);
+    bool get(const std::string &key, Bytes &value);
+
+    // entries whose key starts with prefix, keyed by the rest of the key
+    std::map<std::string, Bytes> scan(const std::string &prefix);
+
+    // writes the snapshot and truncates the log
+    void snapshot();
+    void close();
+
+    template<class... T>
+    void write(const std::string &key, const T&... values) {
+        Ice::OutputStreamPtr out = Ice::createOutputStream(ic);
+        writeAll(out, values...);
+        Bytes bytes;
+        out->finished(bytes);
+        put(key, bytes);
+    }
+
+    template<class... T>
+    void decode(const Bytes &bytes, T&... values) {
+        Ice::InputStreamPtr in = Ice::createInputStream(ic, bytes);
+        readAll(in, values...);
+    }
+
+    template<class... T>
+    bool read(const std::string &key, T&... values) {
+        Bytes bytes;
+        if (!get(key, bytes))
+            return false;
+        decode(bytes, values...);
+        return true;
+    }
+};
+typedef IceUtil::Handle<Store> StorePtr;
+
+// opens the store in dir, or returns null (no persistence) when dir is empty
+StorePtr openStore(const Ice::CommunicatorPtr &ic, const std::string &dir);
+
+#endif
@@ -0,0 +1,501 @@
+#include <Ice/Ice.h>
+#include <SIP.h>
+#include <Servants.h>
+#include <Tram.h>
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+using namespace SIP;
+
+// Stress test of the servants. One communicator serves the stops (through a
+// StopFactoryImpl whose evictor is kept small so stops are evicted and
+// reactivated all the time) and the lines; a second one serves the trams
+// (TramImpl) and passengers, so every call goes over loopback TCP. For
+// MPK.Stress.Seconds these threads run at the same time:
+//
+//   updaters    send arrivals of the trams they own to random stops
+//   registrars  register and unregister their passengers at stops and trams
+//   line        register and unregister their trams at lines, reset stops
+//   movers      move, reroute and query a few TramImpls
+//
+// Afterwards the boards and lines must match what the threads sent, no
+// passenger may have seen the same delta twice and, once every passenger
+// is unregistered, no callback may arrive. Exits 1 when any check fails.
+//
+//   ./stresstest --MPK.Stress.Seconds=30 --MPK.Evictor.Capacity=4
+
+struct StressConfig {
+    int stops, lines, stopsPerLine, trams, movers, passengers;
+    int updaters, registrars, lineThreads, moverThreads, seconds, seed;
+
+    explicit StressConfig(const Ice::PropertiesPtr &props) {
+        stops = max(props->getPropertyAsIntWithDefault("MPK.Stress.Stops", 64), 1);
+        lines = max(props->getPropertyAsIntWithDefault("MPK.Stress.Lines", 8), 1);
+        stopsPerLine = min(max(props->getPropertyAsIntWithDefault("MPK.Stress.StopsPerLine", 10), 2), stops);
+        trams = max(props->getPropertyAsIntWithDefault("MPK.Stress.Trams", 256), 1);
+        movers = max(props->getPropertyAsIntWithDefault("MPK.Stress.Movers", 8), 1);
+        passengers = max(props->getPropertyAsIntWithDefault("MPK.Stress.Passengers", 64), 1);
+        updaters = max(props->getPropertyAsIntWithDefault("MPK.Stress.Updaters", 4), 1);
+        registrars = max(props->getPropertyAsIntWithDefault("MPK.Stress.Registrars", 4), 1);
+        lineThreads = max(props->getPropertyAsIntWithDefault("MPK.Stress.LineThreads", 2), 1);
+        moverThreads = max(props->getPropertyAsIntWithDefault("MPK.Stress.MoverThreads", 4), 1);
+        seconds = max(props->getPropertyAsIntWithDefault("MPK.Stress.Seconds", 5), 1);
+        seed = props->getPropertyAsIntWithDefault("MPK.Stress.Seed", 1);
+    }
+};
+
+// Counts callbacks and remembers every delta sequence number seen per stop.
+class StressPassenger : public Passenger {
+    atomic<Ice::Long> &callbacks;
+    atomic<Ice::Long> &duplicates;
+    mutex mtx;
+    map<string, set<Ice::Long>> seen;
+
+    void delta(const TramStopPrx &stop, Ice::Long seq) {
+        lock_guard<mutex> lock(mtx);
+        if (!seen[stop->ice_getIdentity().name].insert(seq).second)
+            duplicates++;
+    }
+
+public:
+    StressPassenger(atomic<Ice::Long> &c, atomic<Ice::Long> &d) : callbacks(c), duplicates(d) {}
+
+    virtual void updateTramInfo(const TramPrx&, const StopList&, const Ice::Current& = Ice::Current()) override {
+        callbacks++;
+    }
+
+    virtual void updateStopInfo(const TramStopPrx&, const TramList&, const Ice::Current& = Ice::Current()) override {
+        callbacks++;
+    }
+
+    virtual void updateStopDelta(const TramStopPrx &stop, Ice::Long seq, const TramList&, const TramSeq&, const Ice::Current& = Ice::Current()) override {
+        callbacks++;
+        delta(stop, seq);
+    }
+
+    virtual void updateStopInfoBatch(const StopBoardList &boards, const Ice::Current& = Ice::Current()) override {
+        callbacks++;
+        for (const auto &b : boards)
+            delta(b.stop, b.seq);
+    }
+};
+
+// Everything the threads share. The model is split by owner: a tram belongs
+// to one updater and one line thread, so each model entry has one writer.
+struct Stress {
+    StressConfig config;
+    StopSeq stops;
+    vector<LinePrx> lines;
+    vector<TramPrx> trams;
+    vector<TramImpl*> movers;
+    vector<TramPrx> moverProxies;
+    vector<PassengerPrx> passengers;
+
+    // arrival time of tram t at stop s, written by the updater owning t
+    vector<map<string, Ice::Long>> boards;
+    mutex boardsMtx;
+    // trams registered at each line, written by the line thread owning them
+    vector<set<string>> lineTrams;
+    mutex linesMtx;
+
+    atomic<bool> running{true};
+    atomic<Ice::Long> operations{0};
+    atomic<Ice::Long> errors{0};
+
+    explicit Stress(const Ice::PropertiesPtr &props) : config(props) {}
+
+    void failed(const char *what, const Ice::Exception &ex) {
+        errors++;
+        cerr << what << ": " << ex << endl;
+    }
+};
+
+// Arrivals are sent twoway and only for the stop called, so they are
+// applied in order. They carry no move: the random times are not moves of a
+// tram, a real tram numbers its moves and stops drop forwarded entries that
+// were overtaken by a newer one.
+static void update(Stress &s, int id) {
+    mt19937 random(s.config.seed + id);
+    vector<int> mine;
+    for (int t = id; t < s.config.trams; t += s.config.updaters)
+        mine.push_back(t);
+    if (mine.empty())
+        return;
+    Ice::Long base = nowMs() + 60 * 60 * 1000;
+    Ice::Long counter = 0;
+
+    while (s.running) {
+        int stop = random() % s.config.stops;
+        ArrivalList updates;
+        int n = 1 + random() % 4;
+        for (int k = 0; k < n; k++) {
+            int t = mine[random() % mine.size()];
+            updates.push_back(ArrivalUpdate{s.stops[stop], s.trams[t], timestamp(base + random() % 600000 + counter++ % 1000),
+                                            to_string(t), "L" + to_string(t % s.config.lines), 0});
+        }
+        try {
+            if (random() % 8 == 0) {
+                s.stops[stop]->UpdateTramInfo(updates.front().tram, updates.front().time);
+                updates.resize(1);
+            } else {
+                s.stops[stop]->UpdateTramInfoBatch(updates);
+            }
+            lock_guard<mutex> lock(s.boardsMtx);
+            for (const auto &u : updates)
+                s.boards[stop][u.tram->ice_getIdentity().name] = u.time.ms;
+        } catch (const Ice::Exception &ex) {
+            s.failed("arrival update failed", ex);
+        }
+        s.operations++;
+    }
+}
+
+static StopSeq pickStops(Stress &s, mt19937 &random) {
+    StopSeq picked;
+    int n = 1 + random() % 4;
+    for (int k = 0; k < n; k++)
+        picked.push_back(s.stops[random() % s.config.stops]);
+    return picked;
+}
+
+static void registrar(Stress &s, int id) {
+    mt19937 random(s.config.seed + 1000 + id);
+    vector<PassengerPrx> mine;
+    for (int p = id; p < s.config.passengers; p += s.config.registrars)
+        mine.push_back(s.passengers[p]);
+    if (mine.empty())
+        return;
+
+    while (s.running) {
+        const PassengerPrx &p = mine[random() % mine.size()];
+        const TramStopPrx &stop = s.stops[random() % s.config.stops];
+        try {
+            switch (random() % 7) {
+            case 0:
+                stop->RegisterPassenger(p);
+                break;
+            case 1:
+                stop->UnregisterPassenger(p);
+                break;
+            case 2: {
+                SubscriptionFilter filter;
+                filter.lines.push_back("L" + to_string(random() % s.config.lines));
+                filter.maxTrams = 3;
+                filter.horizonMs = 0;
+                filter.minChangeMs = 0;
+                stop->RegisterPassengerFiltered(p, filter);
+                break;
+            }
+            case 3:
+                stop->RegisterPassengerBatch(pickStops(s, random), p);
+                break;
+            case 4:
+                stop->UnregisterPassengerBatch(pickStops(s, random), p);
+                break;
+            case 5:
+                s.moverProxies[random() % s.moverProxies.size()]->RegisterPassenger(p);
+                break;
+            default:
+                s.moverProxies[random() % s.moverProxies.size()]->UnregisterPassenger(p);
+                break;
+            }
+        } catch (const Ice::Exception &ex) {
+            s.failed("passenger registration failed", ex);
+        }
+        s.operations++;
+    }
+
+    // leave everything, nothing may be delivered afterwards
+    for (const auto &p : mine) {
+        try {
+            s.stops.front()->UnregisterPassengerBatch(s.stops, p);
+            for (const auto &stop : s.stops)
+                stop->UnregisterPassenger(p);
+            for (const auto &tram : s.moverProxies)
+                tram->UnregisterPassenger(p);
+        } catch (const Ice::Exception &ex) {
+            s.failed("passenger unregistration failed", ex);
+        }
+    }
+}
+
+static StopList lineStopList(Stress &s, int l) {
+    StopList stops;
+    int first = static_cast<int>(static_cast<long>(l) * s.config.stops / s.config.lines);
+    for (int j = 0; j < s.config.stopsPerLine; j++) {
+        StopInfo info;
+        info.time.ms = j * 60 * 1000;
+        info.stop = s.stops[(first + j) % s.config.stops];
+        info.name = info.stop->ice_getIdentity().name;
+        stops.push_back(info);
+    }
+    return stops;
+}
+
+static void lineWorker(Stress &s, int id) {
+    mt19937 random(s.config.seed + 2000 + id);
+    vector<int> mine;
+    for (int t = id; t < s.config.trams; t += s.config.lineThreads)
+        mine.push_back(t);
+    if (mine.empty())
+        return;
+
+    while (s.running) {
+        int l = random() % s.config.lines;
+        int t = mine[random() % mine.size()];
+        const string &name = s.trams[t]->ice_getIdentity().name;
+        try {
+            int action = random() % 16;
+            if (action == 0) {
+                s.lines[l]->setStops(lineStopList(s, l));
+            } else {
+                bool registered;
+                {
+                    lock_guard<mutex> lock(s.linesMtx);
+                    registered = s.lineTrams[l].count(name) > 0;
+                }
+                // registering again must not add a second entry
+                if (registered && action % 3 != 0) {
+                    s.lines[l]->unregisterTram(s.trams[t]);
+                    lock_guard<mutex> lock(s.linesMtx);
+                    s.lineTrams[l].erase(name);
+                } else {
+                    s.lines[l]->registerTram(s.trams[t]);
+                    lock_guard<mutex> lock(s.linesMtx);
+                    s.lineTrams[l].insert(name);
+                }
+            }
+        } catch (const Ice::Exception &ex) {
+            s.failed("line update failed", ex);
+        }
+        s.operations++;
+    }
+}
+
+// several threads move the same trams, the stop index is what they share
+static void mover(Stress &s, int id) {
+    mt19937 random(s.config.seed + 3000 + id);
+    while (s.running) {
+        int m = random() % s.movers.size();
+        TramImpl *tram = s.movers[m];
+        try {
+            switch (random() % 8) {
+            case 0: {
+                int l = random() % s.config.lines;
+                LinePrx old = tram->getLine();
+                if (old)
+                    old->unregisterTram(s.moverProxies[m]);
+                tram->setLine(s.lines[l]);
+                s.lines[l]->registerTram(s.moverProxies[m]);
+                break;
+            }
+            case 1:
+            case 2:
+                tram->getNextStops(1 + random() % s.config.stopsPerLine);
+                tram->getLocation();
+                tram->getCurrentStopName();
+                break;
+            default:
+                if (!tram->moveToNextStop())
+                    tram->setLine(tram->getLine());
+                break;
+            }
+        } catch (const Ice::Exception &ex) {
+            s.failed("tram move failed", ex);
+        }
+        s.operations++;
+    }
+}
+
+static bool checkBoards(Stress &s) {
+    bool ok = true;
+    for (int i = 0; i < s.config.stops; i++) {
+        Ice::Long seq;
+        map<string, Ice::Long> board;
+        for (const auto &info : s.stops[i]->getBoard(seq)) {
+            const string &name = info.tram->ice_getIdentity().name;
+            // movers update the same stops, they are not modelled
+            if (name.compare(0, 4, "Tram") == 0)
+                board[name] = info.time.ms;
+        }
+        if (board != s.boards[i]) {
+            cerr << "board of " << s.stops[i]->ice_getIdentity().name << " has " << board.size()
+                 << " trams, expected " << s.boards[i].size() << endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static bool checkLines(Stress &s) {
+    bool ok = true;
+    for (int l = 0; l < s.config.lines; l++) {
+        set<string> trams;
+        set<Ice::Identity> identities;
+        for (const auto &info : s.lines[l]->getTrams()) {
+            if (!identities.insert(info.tram->ice_getIdentity()).second) {
+                cerr << "line L" << l << " lists tram " << info.stockNumber << " twice" << endl;
+                ok = false;
+            }
+            const string &name = info.tram->ice_getIdentity().name;
+            if (name.compare(0, 4, "Tram") == 0)
+                trams.insert(name);
+        }
+        if (trams != s.lineTrams[l]) {
+            cerr << "line L" << l << " has " << trams.size() << " trams, expected " << s.lineTrams[l].size() << endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static Ice::InitializationData initData(const Ice::PropertiesPtr &props) {
+    Ice::InitializationData data;
+    data.properties = props;
+    if (props->getProperty("Ice.ThreadPool.Server.Size").empty())
+        props->setProperty("Ice.ThreadPool.Server.Size", "8");
+    if (props->getProperty("Ice.ThreadPool.Client.Size").empty())
+        props->setProperty("Ice.ThreadPool.Client.Size", "4");
+    // a lost call is reported as an error instead of hanging the test
+    if (props->getProperty("Ice.Default.InvocationTimeout").empty())
+        props->setProperty("Ice.Default.InvocationTimeout", "10000");
+    return data;
+}
+
+int main(int argc, char* argv[]) {
+    int status = 0;
+    Ice::CommunicatorPtr serverIc, clientIc;
+    streambuf *out = cout.rdbuf();
+
+    try {
+        Ice::PropertiesPtr props = Ice::createProperties(argc, argv);
+        Stress s(props);
+        // few resident stops, so eviction runs alongside everything else
+        if (props->getProperty("MPK.Evictor.Capacity").empty())
+            props->setProperty("MPK.Evictor.Capacity", to_string(max(s.config.stops / 4, 1)));
+        serverIc = Ice::initialize(argc, argv, initData(props));
+        clientIc = Ice::initialize(initData(props->clone()));
+        initServants(serverIc);
+
+        cout << s.config.stops << " stops (" << props->getProperty("MPK.Evictor.Capacity") << " resident), "
+             << s.config.lines << " lines, " << s.config.trams << " trams, " << s.config.movers << " moving, "
+             << s.config.passengers << " passengers for " << s.config.seconds << "s" << endl;
+        // the servants log every call
+        cout.rdbuf(nullptr);
+
+        Ice::ObjectAdapterPtr serverAdapter = serverIc->createObjectAdapterWithEndpoints("StressServer", "tcp -h 127.0.0.1");
+        StopFactoryImpl *factoryImpl = new StopFactoryImpl(serverAdapter);
+        Ice::ObjectPtr factory = factoryImpl;
+        serverAdapter->activate();
+
+        NameList names;
+        for (int i = 0; i < s.config.stops; i++)
+            names.push_back("Stop" + to_string(i));
+        for (const auto &stop : factoryImpl->createStops(names, Ice::Current()))
+            s.stops.push_back(TramStopPrx::uncheckedCast(clientIc->stringToProxy(stop->ice_toString())));
+        s.boards.resize(s.config.stops);
+
+        for (int l = 0; l < s.config.lines; l++) {
+            Ice::ObjectPrx line = serverAdapter->add(new LineImpl("L" + to_string(l), 0),
+                                                     Ice::stringToIdentity("L" + to_string(l)));
+            s.lines.push_back(LinePrx::uncheckedCast(clientIc->stringToProxy(line->ice_toString())));
+            s.lines.back()->setStops(lineStopList(s, l));
+        }
+        s.lineTrams.resize(s.config.lines);
+
+        Ice::ObjectAdapterPtr clientAdapter = clientIc->createObjectAdapterWithEndpoints("StressClients", "tcp -h 127.0.0.1");
+        clientAdapter->activate();
+        for (int t = 0; t < s.config.trams; t++) {
+            TramImpl *tram = new TramImpl(to_string(t));
+            s.trams.push_back(TramPrx::uncheckedCast(clientAdapter->add(tram, Ice::stringToIdentity("Tram" + to_string(t)))));
+            tram->setSelfProxy(s.trams.back());
+        }
+        for (int m = 0; m < s.config.movers; m++) {
+            TramImpl *tram = new TramImpl("M" + to_string(m));
+            s.moverProxies.push_back(TramPrx::uncheckedCast(clientAdapter->add(tram, Ice::stringToIdentity("Mover" + to_string(m)))));
+            tram->setSelfProxy(s.moverProxies.back());
+            tram->setStopsCheck(50);
+            tram->setLine(s.lines[m % s.config.lines]);
+            s.movers.push_back(tram);
+        }
+
+        atomic<Ice::Long> callbacks{0};
+        atomic<Ice::Long> duplicates{0};
+        for (int p = 0; p < s.config.passengers; p++)
+            s.passengers.push_back(PassengerPrx::uncheckedCast(
+                    clientAdapter->add(new StressPassenger(callbacks, duplicates), Ice::stringToIdentity("Passenger" + to_string(p)))));
+
+        // a deadlock would otherwise hang the test forever
+        thread([&s] {
+            this_thread::sleep_for(chrono::seconds(s.config.seconds * 4 + 60));
+            cerr << "stress test did not finish, deadlock?" << endl;
+            _exit(2);
+        }).detach();
+
+        vector<thread> threads;
+        for (int i = 0; i < s.config.updaters; i++)
+            threads.emplace_back([&s, i] { update(s, i); });
+        for (int i = 0; i < s.config.registrars; i++)
+            threads.emplace_back([&s, i] { registrar(s, i); });
+        for (int i = 0; i < s.config.lineThreads; i++)
+            threads.emplace_back([&s, i] { lineWorker(s, i); });
+        for (int i = 0; i < s.config.moverThreads; i++)
+            threads.emplace_back([&s, i] { mover(s, i); });
+
+        this_thread::sleep_for(chrono::seconds(s.config.seconds));
+        s.running = false;
+        for (auto &t : threads)
+            t.join();
+
+        // notifications posted before the passengers left may still arrive,
+        // after that nothing may
+        int quietMs = max(defaultCoalesceWindowMs, 0) + 1000;
+        this_thread::sleep_for(chrono::milliseconds(quietMs));
+        Ice::Long before = callbacks;
+        this_thread::sleep_for(chrono::milliseconds(quietMs));
+        Ice::Long late = callbacks - before;
+
+        bool boardsOk = checkBoards(s);
+        bool linesOk = checkLines(s);
+        CacheStats cache = factoryImpl->getCacheStats(Ice::Current());
+        cout.rdbuf(out);
+
+        cout << s.operations << " operations, " << callbacks << " callbacks, "
+             << cache.evictions << " evictions, " << s.errors << " errors" << endl;
+        cout << "boards: " << (boardsOk ? "ok" : "FAILED") << endl;
+        cout << "lines: " << (linesOk ? "ok" : "FAILED") << endl;
+        cout << "duplicate deltas: " << duplicates << endl;
+        cout << "callbacks after unregistering: " << late << endl;
+        if (!boardsOk || !linesOk || duplicates > 0 || late > 0 || s.errors > 0)
+            status = 1;
+    } catch (const Ice::Exception &ex) {
+        cout.rdbuf(out);
+        cerr << ex << endl;
+        status = 1;
+    } catch (const exception &ex) {
+        cout.rdbuf(out);
+        cerr << ex.what() << endl;
+        status = 1;
+    }
+
+    cout << (status ? "stress test failed" : "stress test passed") << endl;
+    if (clientIc) {
+        try {
+            clientIc->destroy();
+        } catch (const Ice::Exception &) {
+        }
+    }
+    if (serverIc) {
+        destroyServants(serverIc);
+        try {
+            serverIc->destroy();
+        } catch (const Ice::Exception &) {
+        }
+    }
+    return status;
+}
@@ -0,0 +1,94 @@
+#ifndef SUBSCRIPTION_H
+#define SUBSCRIPTION_H
+
+#include <Ice/Ice.h>
+#include <SIP.h>
+#include <algorithm>
+#include <string>
+
+// Passenger subscriptions, shared by stops, trams and relays: where callbacks
+// go and, for server side filters (SubscriptionFilter), what a filtered
+// passenger sees and whether a new view is worth sending.
+
+using namespace SIP;
+
+// the server process behind proxy, proxies with the same endpoints reach the same one
+inline std::string serverKey(const Ice::ObjectPrx &proxy) {
+    std::string key;
+    for (const auto &endpoint : proxy->ice_getEndpoints())
+        key += endpoint->toString() + ":";
+    return key;
+}
+
+// Passengers registering with a proxy without endpoints listen on the
+// connection they called in on (bidirectional), the callbacks go back over it.
+inline PassengerPrx callbackProxy(const PassengerPrx &p, const Ice::Current &current) {
+    if (!p || !current.con || !p->ice_getEndpoints().empty())
+        return p;
+    return PassengerPrx::uncheckedCast(current.con->createProxy(p->ice_getIdentity()));
+}
+
+inline bool lineWanted(const SubscriptionFilter &filter, const std::string &line) {
+    return filter.lines.empty() || std::find(filter.lines.begin(), filter.lines.end(), line) != filter.lines.end();
+}
+
+inline bool withinHorizon(const SubscriptionFilter &filter, const Timestamp &time, Ice::Long now) {
+    return filter.horizonMs <= 0 || time.ms <= now + filter.horizonMs;
+}
+
+inline bool full(const SubscriptionFilter &filter, size_t size) {
+    return filter.maxTrams > 0 && size >= static_cast<size_t>(filter.maxTrams);
+}
+
+// board is ordered by time, so the horizon ends the walk
+inline TramList filterBoard(const TramList &board, const SubscriptionFilter &filter, Ice::Long now) {
+    TramList view;
+    for (const auto &info : board) {
+        if (full(filter, view.size()) || !withinHorizon(filter, info.time, now))
+            break;
+        if (lineWanted(filter, info.line))
+            view.push_back(info);
+    }
+    return view;
+}
+
+// stops of a tram running on line, none when the filter does not want the line
+inline StopList filterStops(const StopList &stops, const std::string &line, const SubscriptionFilter &filter, Ice::Long now) {
+    StopList view;
+    if (!lineWanted(filter, line))
+        return view;
+    for (const auto &info : stops) {
+        if (full(filter, view.size()) || !withinHorizon(filter, info.time, now))
+            break;
+        view.push_back(info);
+    }
+    return view;
+}
+
+inline Ice::Identity identityOf(const TramInfo &info) {
+    return info.tram ? info.tram->ice_getIdentity() : Ice::Identity();
+}
+
+inline Ice::Identity identityOf(const StopInfo &info) {
+    return info.stop ? info.stop->ice_getIdentity() : Ice::Identity();
+}
+
+// true when an entry joined, left or moved in view, or its time changed by
+// at least minChangeMs
+template<class Seq>
+bool changedMaterially(const Seq &last, const Seq &view, Ice::Long minChangeMs) {
+    if (last.size() != view.size())
+        return true;
+    for (size_t i = 0; i < view.size(); i++) {
+        if (identityOf(last[i]) != identityOf(view[i]))
+            return true;
+        Ice::Long moved = view[i].time.ms - last[i].time.ms;
+        if (moved < 0)
+            moved = -moved;
+        if (moved > 0 && moved >= minChangeMs)
+            return true;
+    }
+    return false;
+}
+
+#endif
@@ -1,317 +1,40 @@
 #include <Ice/Ice.h>
 #include <SIP.h>
-#include <map>
-#include <vector>
-#include <mutex>
+#include <Servants.h>
+#include <Network.h>
+#include <MPK.h>
+#include <sstream>
+#include <thread>
 
 using namespace std;
 using namespace SIP;
 
-class TramStopI;
-class DepoI;
-class LineI;
-class MPKImpl;
-
-
-class MPKImpl : public MPK {
-    map<string, TramStopPrx> tramStops;
-    map<string, DepoPrx> depos;
-    vector<LinePrx> lines;
-    vector<LineFactoryPrx> lineFactories;
-    vector<StopFactoryPrx> stopFactories;
-
-public:
-    virtual TramStopPrx getTramStop(const string& name, const Ice::Current& = Ice::Current()) override {
-        auto it = tramStops.find(name);
-        if (it != tramStops.end())
-            return it->second;
-        throw runtime_error("Tram stop not found");
-    }
-
-    virtual void registerDepo(const DepoPrx& depo, const Ice::Current& = Ice::Current()) override {
-        depos[depo->getName()] = depo;
-    }
-
-    virtual void unregisterDepo(const DepoPrx& depo, const Ice::Current& = Ice::Current()) override {
-        depos.erase(depo->getName());
-    }
-
-    virtual DepoPrx getDepo(const string& name, const Ice::Current& = Ice::Current()) override {
-        return depos.at(name);
-    }
-
-    virtual DepoList getDepos(const Ice::Current& = Ice::Current()) override {
-        DepoList list;
-        for (auto& kv : depos) {
-            DepoInfo info;
-            info.name = kv.first;
-            info.stop = kv.second;
-            list.push_back(info);
-        }
-        return list;
-    }
-
-    virtual LineList getLines(const Ice::Current& = Ice::Current()) override {
-        return lines;
-    }
-
-    virtual void registerLineFactory(const LineFactoryPrx &lf, const Ice::Current& = Ice::Current()) override {
-        lineFactories.push_back(lf);
-    }
-
-    virtual void unregisterLineFactory(const LineFactoryPrx &lf, const Ice::Current& = Ice::Current()) override {
-        lineFactories.erase(remove(lineFactories.begin(), lineFactories.end(), lf), lineFactories.end());
-    }
-
-    virtual void registerStopFactory(const StopFactoryPrx &sf, const Ice::Current& = Ice::Current()) override {
-        stopFactories.push_back(sf);
-    }
-
-    virtual void unregisterStopFactory(const StopFactoryPrx &sf, const Ice::Current& = Ice::Current()) override {
-        stopFactories.erase(remove(stopFactories.begin(), stopFactories.end(), sf), stopFactories.end());
-    }
-
-
-    void addTramStop(const TramStopPrx &ts) {
-        tramStops[ts->getName()] = ts;
-    }
-    void addLine(const LinePrx &lineProxy) {
-        lines.push_back(lineProxy);
-    }
-};
-Ice::ObjectPtr createMPKImpl() {
-    return new MPKImpl();
-}
-
-class DepoImpl : public Depo {
-    string name;
-    set<TramPrx> onlineTrams;
-public:
-    DepoImpl(const string &n) : name(n) {}
-    virtual void TramOnline(const TramPrx &t, const Ice::Current& = Ice::Current()) override {
-        onlineTrams.insert(t);
-        cout << "tram " << t->getStockNumber() << " is online at " << name << "depo" <<  endl;
-    }
-    virtual void TramOffline(const TramPrx &t, const Ice::Current& = Ice::Current()) override {
-        onlineTrams.erase(t);
-        cout << "tram " << t->getStockNumber() << " is offline at " << name << "depo" << endl;
-    }
-    virtual string getName(const Ice::Current& = Ice::Current()) override {
-        return name;
-    }
-};
-
-Ice::ObjectPtr createDepoImpl(const string &name) {
-    return new DepoImpl(name);
-}
-
-
-class LineImpl : public Line {
-    string name;
-    TramList trams;
-    StopList stops;
-public:
-    LineImpl(const string &n) : name(n) {}
-
-    virtual TramList getTrams(const Ice::Current& = Ice::Current()) override {
-        return trams;
-    }
-    virtual StopList getStops(const Ice::Current& = Ice::Current()) override {
-        return stops;
-    }
-    virtual void registerTram(const TramPrx &tram, const Ice::Current& = Ice::Current()) override {
-        TramInfo info;
-        info.time.hour = 0;
-        info.time.minute = 0;
-        info.tram = tram;
-        trams.push_back(info);
-        cout << "registered tram " << tram->getStockNumber() << " on line " << name << endl;
-    }
-    virtual void unregisterTram(const TramPrx &tram, const Ice::Current& = Ice::Current()) override {
-        auto it = remove_if(trams.begin(), trams.end(), [tram](const TramInfo &info) {
-            return info.tram == tram;
-        });
-        trams.erase(it, trams.end());
-        cout << "unregistered tram " << tram->getStockNumber() << " from line " << name << endl;
-    }
-    virtual void setStops(const StopList &sl, const Ice::Current& = Ice::Current()) override {
-        stops = sl;
-        cout << "added stops for line  " << name << endl;
-    }
-    virtual string getName(const Ice::Current& = Ice::Current()) override {
-        return name;
-    }
-};
-
-Ice::ObjectPtr createLineImpl(const string &name) {
-    return new LineImpl(name);
-}
-
-class TramStopImpl : public TramStop {
-    string name;
-    set<PassengerPrx> passengers;
-    TramList upcomingTrams;
-    TramStopPrx selfProxy;
-public:
-    TramStopImpl(const string &n) : name(n) {}
-
-    void setSelfProxy(const TramStopPrx &proxy) {
-        selfProxy = proxy;
-    }
-
-    virtual string getName(const Ice::Current& = Ice::Current()) override {
-        return name;
-    }
-
-    virtual TramList getNextTrams(int howMany, const Ice::Current& = Ice::Current()) override {
-        TramList result;
-        int count = 0;
-        for(const auto &ti : upcomingTrams) {
-            if(count >= howMany)
-                break;
-            result.push_back(ti);
-            count++;
-        }
-        return result;
-    }
-
-    virtual void RegisterPassenger(const PassengerPrx &p, const Ice::Current& = Ice::Current()) override {
-        passengers.insert(p);
-        cout << "passenger registered at stop " << name << endl;
-
-        if (!upcomingTrams.empty() && selfProxy) {
-            TramStopPrx stopProxy = selfProxy;
-            TramList tramsCopy = upcomingTrams;
-
-            Ice::AsyncResultPtr result = p->begin_updateStopInfo(stopProxy, tramsCopy);
-        }
-    }
-
-
-    virtual void UnregisterPassenger(const PassengerPrx &p, const Ice::Current& = Ice::Current()) override {
-        passengers.erase(p);
-        cout << "passenger unregistered at stop " << name << endl;
-    }
-
-    virtual void UpdateTramInfo(const TramPrx &tram, const Time& time, const Ice::Current& = Ice::Current()) override {
-        bool tramFound = false;
-        for (auto &ti : upcomingTrams) {
-            if (ti.tram == tram) {
-                ti.time = time;
-                tramFound = true;
-                break;
-            }
-        }
-
-        if (!tramFound) {
-            TramInfo info;
-            info.time = time;
-            info.tram = tram;
-            upcomingTrams.push_back(info);
-        }
-
-        sort(upcomingTrams.begin(), upcomingTrams.end(),
-             [](const TramInfo &a, const TramInfo &b) {
-                 if (a.time.hour != b.time.hour)
-                     return a.time.hour < b.time.hour;
-                 return a.time.minute < b.time.minute;
-             });
-
-        Time currentTime;
-        auto now = chrono::system_clock::now();
-        time_t currentTimeT = chrono::system_clock::to_time_t(now);
-        tm* timeinfo = localtime(&currentTimeT);
-        currentTime.hour = timeinfo->tm_hour;
-        currentTime.minute = timeinfo->tm_min;
-
-        upcomingTrams.erase(
-                remove_if(upcomingTrams.begin(), upcomingTrams.end(),
-                          [&currentTime](const TramInfo &ti) {
-                              return (ti.time.hour < currentTime.hour) ||
-                                     (ti.time.hour == currentTime.hour && ti.time.minute < currentTime.minute);
-                          }),
-                upcomingTrams.end());
-
-        for (const auto &p : passengers) {
-            if (selfProxy) {
-                TramStopPrx stopProxy = selfProxy;
-                TramList tramsCopy = upcomingTrams;
-
-                Ice::AsyncResultPtr result = p->begin_updateStopInfo(stopProxy, tramsCopy);
-            } else {
-                cerr << "Cannot notify passengers: selfProxy not set for stop " << name << endl;
-            }
-        }
-
-    }
-};
-
-Ice::ObjectPtr createTramStopImpl(const string &name) {
-    return new TramStopImpl(name);
-}
-
-class LineFactoryImpl : public LineFactory {
-    Ice::ObjectAdapterPtr adapter;
-    map<string, LinePrx> lines;
-    mutable std::mutex mtx;
-
-public:
-    LineFactoryImpl(const Ice::ObjectAdapterPtr& adapter) : adapter(adapter) {}
-
-    virtual LinePrx createLine(const string& name, const Ice::Current&) override {
-        std::lock_guard<std::mutex> lock(mtx);
-        if (lines.find(name) != lines.end()) {
-            return lines[name];
-        }
-
-        Ice::ObjectPtr lineImpl = new LineImpl(name);
-        Ice::Identity id = Ice::stringToIdentity(name);
-        adapter->add(lineImpl, id);
-        LinePrx lineProxy = LinePrx::uncheckedCast(adapter->createProxy(id));
-        lines[name] = lineProxy;
-        return lineProxy;
-    }
-
-    virtual double getLoad(const Ice::Current&) override {
-        std::lock_guard<std::mutex> lock(mtx);
-        return static_cast<double>(lines.size());
-    }
-};
-
-class StopFactoryImpl : public StopFactory {
-    Ice::ObjectAdapterPtr adapter;
-    map<string, TramStopPrx> stops;
-    mutable std::mutex mtx;
-
-public:
-    StopFactoryImpl(const Ice::ObjectAdapterPtr& adapter) : adapter(adapter) {}
-
-    virtual TramStopPrx createStop(const string& name, const Ice::Current&) override {
-        std::lock_guard<std::mutex> lock(mtx);
-        if (stops.find(name) != stops.end()) {
-            return stops[name];
-        }
-
-        Ice::ObjectPtr stopImpl = new TramStopImpl(name);
-        Ice::Identity id = Ice::stringToIdentity(name);
-        adapter->add(stopImpl, id);
-        TramStopPrx stopProxy = TramStopPrx::uncheckedCast(adapter->createProxy(id));
-        stops[name] = stopProxy;
-        return stopProxy;
-    }
-
-    virtual double getLoad(const Ice::Current&) override {
-        std::lock_guard<std::mutex> lock(mtx);
-        return static_cast<double>(stops.size());
-    }
-};
-
 int main(int argc, char* argv[]) {
     int status = 0;
     Ice::CommunicatorPtr ic;
+    IceUtil::TimerPtr registryTimer;
+    StorePtr store;
 
     try {
-        ic = Ice::initialize(argc, argv);
+        // every servant synchronizes its own state, so the server pool can
+        // grow with the machine unless it was configured explicitly
+        Ice::InitializationData initData;
+        initData.properties = Ice::createProperties(argc, argv);
+        if (initData.properties->getProperty("Ice.ThreadPool.Server.Size").empty()) {
+            int cores = max(static_cast<int>(thread::hardware_concurrency()), 1);
+            initData.properties->setProperty("Ice.ThreadPool.Server.Size", to_string(cores));
+            initData.properties->setProperty("Ice.ThreadPool.Server.SizeMax", to_string(cores * 2));
+        }
+        ic = Ice::initialize(argc, argv, initData);
+
+        initServants(ic);
+        Ice::PropertiesPtr props = ic->getProperties();
+        // persistence is off unless MPK.Store.Dir is set
+        try {
+            store = openStore(ic, props->getProperty("MPK.Store.Dir"));
+        } catch (const exception &ex) {
+            cerr << "cant open store, running without persistence: " << ex.what() << endl;
+        }
 
         Ice::ObjectAdapterPtr mpkAdapter = ic->createObjectAdapterWithEndpoints("MPKAdapter", "default -p 10000");
         Ice::ObjectAdapterPtr depoAdapter = ic->createObjectAdapterWithEndpoints("DepoAdapter", "default -p 10003");
@@ -325,17 +48,19 @@ int main(int argc, char* argv[]) {
         factoryAdapter->activate();
 
         MPKImpl* mpkImpl = new MPKImpl();
+        mpkImpl->setPlacement(props->getPropertyWithDefault("MPK.Placement", "hash"));
+        bool recovered = store && mpkImpl->recover(store);
         mpkAdapter->add(mpkImpl, Ice::stringToIdentity("MPK"));
         MPKPrx mpkProxy = MPKPrx::uncheckedCast(mpkAdapter->createProxy(Ice::stringToIdentity("MPK")));
 
-        Ice::ObjectPtr lineFactory = new LineFactoryImpl(lineAdapter);
+        Ice::ObjectPtr lineFactory = new LineFactoryImpl(lineAdapter, mpkProxy, store);
         factoryAdapter->add(lineFactory, Ice::stringToIdentity("LineFactory"));
         LineFactoryPrx lineFactoryProxy = LineFactoryPrx::uncheckedCast(
                 factoryAdapter->createProxy(Ice::stringToIdentity("LineFactory"))
         );
         mpkProxy->registerLineFactory(lineFactoryProxy);
 
-        Ice::ObjectPtr stopFactory = new StopFactoryImpl(stopAdapter);
+        Ice::ObjectPtr stopFactory = new StopFactoryImpl(stopAdapter, store);
         factoryAdapter->add(stopFactory, Ice::stringToIdentity("StopFactory"));
         StopFactoryPrx stopFactoryProxy = StopFactoryPrx::uncheckedCast(
                 factoryAdapter->createProxy(Ice::stringToIdentity("StopFactory"))
@@ -366,24 +91,54 @@ int main(int argc, char* argv[]) {
         DepoPrx depoProxy = DepoPrx::uncheckedCast(depoAdapter->createProxy(Ice::stringToIdentity("Depo1")));
         mpkProxy->registerDepo(depoProxy);
 
-        LinePrx line1Proxy = lineFactoryProxy->createLine("Line1");
-        mpkImpl->addLine(line1Proxy);
+        registryTimer = new IceUtil::Timer();
+        registryTimer->scheduleRepeated(new LoadRefreshTask(mpkImpl),
+                                    IceUtil::Time::milliSeconds(props->getPropertyAsIntWithDefault("MPK.LoadRefreshMs", 5000)));
+
+        // unreachable factories, relays and trams are dropped after MPK.Liveness.MaxFailures
+        // checks, one every MPK.Liveness.PeriodMs (0 disables it)
+        mpkImpl->setLiveness(props->getPropertyAsIntWithDefault("MPK.Liveness.TimeoutMs", 2000),
+                             props->getPropertyAsIntWithDefault("MPK.Liveness.MaxFailures", 3));
+        int livenessMs = props->getPropertyAsIntWithDefault("MPK.Liveness.PeriodMs", 10000);
+        if (livenessMs > 0)
+            registryTimer->scheduleRepeated(new LivenessTask(mpkImpl), IceUtil::Time::milliSeconds(livenessMs));
+
+        // the network is only built from scratch when the store had none, from
+        // MPK.Network if it is set, otherwise the built-in one
+        string networkFile = props->getProperty("MPK.Network");
+        if (recovered && !networkFile.empty()) {
+            cout << "network recovered from " << props->getProperty("MPK.Store.Dir")
+                 << ", MPK.Network " << networkFile << " is not loaded" << endl;
+        }
+        else if (!recovered && !networkFile.empty()) {
+            try {
+                IceUtil::Time start = IceUtil::Time::now(IceUtil::Time::Monotonic);
+                Network network = loadNetwork(networkFile);
+                mpkImpl->loadNetwork(network);
+                cout << "loaded " << network.stops.size() << " stops and " << network.lines.size() << " lines in "
+                     << (IceUtil::Time::now(IceUtil::Time::Monotonic) - start).toMilliSeconds() << " ms" << endl;
+            } catch (const exception &ex) {
+                cerr << "cant load network: " << ex.what() << endl;
+            }
+        }
+        else if (!recovered) {
+            LinePrx line1Proxy = mpkProxy->createLine("Line1");
 
-        StopList stopList;
-        stopList.push_back(StopInfo{Time{0, 0}, stopAProxy});
-        stopList.push_back(StopInfo{Time{0, 5}, stopBProxy});
-        stopList.push_back(StopInfo{Time{0, 10}, stopCProxy});
-        line1Proxy->setStops(stopList);
+            StopList stopList;
+            stopList.push_back(StopInfo{timestamp(0), stopAProxy, "StopA"});
+            stopList.push_back(StopInfo{timestamp(5 * 60 * 1000), stopBProxy, "StopB"});
+            stopList.push_back(StopInfo{timestamp(10 * 60 * 1000), stopCProxy, "StopC"});
+            line1Proxy->setStops(stopList);
 
-        LinePrx line2Proxy = lineFactoryProxy->createLine("Line2");
-        mpkImpl->addLine(line2Proxy);
+            LinePrx line2Proxy = mpkProxy->createLine("Line2");
 
-        StopList stopList2;
-        stopList2.push_back(StopInfo{Time{0, 0}, stopCProxy});
-        stopList2.push_back(StopInfo{Time{0, 5}, stopBProxy});
-        stopList2.push_back(StopInfo{Time{0, 10}, stopAProxy});
+            StopList stopList2;
+            stopList2.push_back(StopInfo{timestamp(0), stopCProxy, "StopC"});
+            stopList2.push_back(StopInfo{timestamp(5 * 60 * 1000), stopBProxy, "StopB"});
+            stopList2.push_back(StopInfo{timestamp(10 * 60 * 1000), stopAProxy, "StopA"});
 
-        line2Proxy->setStops(stopList2);
+            line2Proxy->setStops(stopList2);
+        }
 
         cout << "running...\n" << endl;
 
@@ -395,6 +150,7 @@ int main(int argc, char* argv[]) {
         cout << "line <name>  - details about a line" << endl;
         cout << "stop <name>  - details about a stop" << endl;
         cout << "depos        - list deops" << endl;
+        cout << "cache        - evictor stats for local lines and stops" << endl;
         cout << "exit         - exit" << endl;
 
         while (running) {
@@ -410,17 +166,21 @@ int main(int argc, char* argv[]) {
                 cout << "closing..." << endl;
             }
             else if (cmd == "lines") {
-                LineList lines = mpkProxy->getLines();
                 cout << "\nLines:" << endl;
 
-                if (lines.empty()) {
-                    cout << "no lines" << endl;
-                }
-                else {
+                LineIteratorPrx iterator = mpkProxy->iterateLines();
+                bool more = true;
+                bool any = false;
+                while (more) {
+                    LineList lines = iterator->next(50, more);
                     for (const auto& line : lines) {
                         cout << "line: " << line->getName() << endl;
+                        any = true;
                     }
                 }
+                if (!any) {
+                    cout << "no lines" << endl;
+                }
             }
             else if (cmd == "line") {
                 string lineName;
@@ -448,8 +208,9 @@ int main(int argc, char* argv[]) {
                 }
 
                 StopList stops = foundLine->getStops();
-                for (const auto& stop : stops) {
-                    cout << "- " << stop.stop->getName() <<" (Arrival time: " << stop.time.hour << ":" << stop.time.minute << ")" << endl;
+                Timetable timetable(stops);
+                for (size_t i = 0; i < stops.size(); i++) {
+                    cout << "- " << stops[i].name << " (+" << timetable.offset(i) / 60000 << " min)" << endl;
                 }
 
                 cout << "\ntrams" << endl;
@@ -459,7 +220,7 @@ int main(int argc, char* argv[]) {
                 }
                 else {
                     for (const auto& tram : trams) {
-                        cout << "- tram number: " << tram.tram->getStockNumber() << endl;
+                        cout << "- tram number: " << tram.stockNumber << endl;
                     }
                 }
             }
@@ -480,10 +241,14 @@ int main(int argc, char* argv[]) {
                     }
                     else {
                         for (const auto& tram : nextTrams) {
-                            cout << "- tram " << tram.tram->getStockNumber() << " (Arrival: "
-                                 << tram.time.hour << ":" << tram.time.minute<< ")" << endl;
+                            cout << "- tram " << tram.stockNumber << " (Arrival: " << formatClock(tram.time) << ")" << endl;
                         }
                     }
+
+                    NotifyStats stats = stop->getNotifyStats();
+                    cout << "updates: " << stats.updates << ", notifications: " << stats.flushes
+                         << ", pushes sent: " << stats.pushesSent << ", pushes saved: " << stats.pushesSaved
+                         << ", passengers dropped: " << stats.pruned << endl;
                 } catch (const std::exception& ex) {
                     cout << "error getting stop info: " << endl;
                 }
@@ -500,13 +265,36 @@ int main(int argc, char* argv[]) {
                     }
                 }
             }
+            else if (cmd == "cache") {
+                CacheStats lineStats = lineFactoryProxy->getCacheStats();
+                CacheStats stopStats = stopFactoryProxy->getCacheStats();
+                cout << "lines - resident: " << lineStats.resident << ", hits: " << lineStats.hits
+                     << ", misses: " << lineStats.misses << ", evictions: " << lineStats.evictions << endl;
+                cout << "stops - resident: " << stopStats.resident << ", hits: " << stopStats.hits
+                     << ", misses: " << stopStats.misses << ", evictions: " << stopStats.evictions << endl;
+            }
             else {
                 cout << "unknown command" << endl;
             }
         }
+        registryTimer->destroy();
+        destroyServants(ic);
+        if (store)
+            store->close();
         if (ic) ic->destroy();
     } catch (const Ice::Exception& ex) {
         cerr << ex << endl;
+        if (registryTimer)
+            registryTimer->destroy();
+        destroyServants(ic);
+        if (store)
+            store->close();
+        if (ic) {
+            try {
+                ic->destroy();
+            } catch (const Ice::Exception &) {
+            }
+        }
         status = 1;
     }
 
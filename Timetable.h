@@ -0,0 +1,81 @@
+#ifndef TIMETABLE_H
+#define TIMETABLE_H
+
+#include <SIP.h>
+#include <chrono>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// Timetable of a line, shared by trams and the System process. StopInfo.time
+// of a line's stops is the running time from the first stop; it is turned
+// once into a flat array of cumulative milliseconds, so the ETA between any
+// two stops is a subtraction and an ETA on the clock one more addition.
+
+using namespace SIP;
+
+// milliseconds since the epoch, every Timestamp on the wire comes from here
+inline Ice::Long nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline Timestamp timestamp(Ice::Long ms) {
+    Timestamp t;
+    t.ms = ms;
+    return t;
+}
+
+// local wall clock "hh:mm", only for display
+inline std::string formatClock(const Timestamp &t) {
+    time_t seconds = static_cast<time_t>(t.ms / 1000);
+    tm local;
+    localtime_r(&seconds, &local);
+    char text[8];
+    strftime(text, sizeof(text), "%H:%M", &local);
+    return text;
+}
+
+class Timetable {
+    std::vector<Ice::Long> offsets;
+
+public:
+    // used for segments without a positive running time
+    static const Ice::Long defaultSegmentMs = 5 * 60 * 1000;
+
+    Timetable() {}
+
+    explicit Timetable(const StopList &stops) {
+        offsets.reserve(stops.size());
+        for (size_t i = 0; i < stops.size(); i++) {
+            if (i == 0) {
+                offsets.push_back(0);
+                continue;
+            }
+            Ice::Long segment = stops[i].time.ms - stops[i - 1].time.ms;
+            if (segment <= 0)
+                segment = defaultSegmentMs;
+            offsets.push_back(offsets.back() + segment);
+        }
+    }
+
+    size_t size() const {
+        return offsets.size();
+    }
+
+    // milliseconds from the first stop
+    Ice::Long offset(size_t stop) const {
+        return offsets[stop];
+    }
+
+    // milliseconds from stop from to stop to
+    Ice::Long between(size_t from, size_t to) const {
+        return offsets[to] - offsets[from];
+    }
+
+    // arrival at stop to for a tram that was at stop from at departure
+    Timestamp eta(Ice::Long departure, size_t from, size_t to) const {
+        return timestamp(departure + between(from, to));
+    }
+};
+
+#endif
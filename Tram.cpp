@@ -1,186 +1,11 @@
 #include <Ice/Ice.h>
 #include <SIP.h>
+#include <Tram.h>
 #include <iostream>
-#include <vector>
-#include <chrono>
-#include <map>
 
 using namespace std;
 using namespace SIP;
 
-class TramImpl : public Tram {
-    string stockNumber;
-    TramStopPrx currentStop;
-    LinePrx line;
-    vector<PassengerPrx> passengers;
-    int currentStopIndex = -1;
-
-public:
-    TramImpl(const string &sn) : stockNumber(sn) {}
-
-    virtual TramStopPrx getLocation(const Ice::Current & = Ice::Current()) override {
-        return currentStop;
-    }
-
-    virtual LinePrx getLine(const Ice::Current & = Ice::Current()) override {
-        return line;
-    }
-
-    virtual void setLine(const LinePrx &l, const Ice::Current & = Ice::Current()) override {
-        line = l;
-        currentStopIndex = -1;
-    }
-
-    virtual StopList getNextStops(int howMany, const Ice::Current & = Ice::Current()) override {
-        StopList result;
-
-        if (!line || currentStopIndex < 0)
-            return result;
-
-        StopList allStops = line->getStops();
-        if (allStops.empty() || currentStopIndex >= static_cast<int>(allStops.size()))
-            return result;
-
-        auto baseTime = std::chrono::system_clock::now();
-
-        for (int i = currentStopIndex + 1; i < allStops.size() && result.size() < howMany; ++i) {
-            int minutesToAdd = (i - currentStopIndex +1) * 5;
-            auto futureTime = baseTime + std::chrono::minutes(minutesToAdd);
-            std::time_t futureTimeT = std::chrono::system_clock::to_time_t(futureTime);
-            std::tm *timeinfo = std::localtime(&futureTimeT);
-
-            Time estimatedTime;
-            estimatedTime.hour = timeinfo->tm_hour;
-            estimatedTime.minute = timeinfo->tm_min;
-
-            StopInfo stopWithTime = allStops[i];
-            stopWithTime.time = estimatedTime;
-
-            result.push_back(stopWithTime);
-        }
-
-        return result;
-    }
-
-
-    virtual void RegisterPassenger(const PassengerPrx &p, const Ice::Current & = Ice::Current()) override {
-        passengers.push_back(p);
-        cout << "passenger registered on tram " << endl;
-    }
-
-    virtual void UnregisterPassenger(const PassengerPrx &p, const Ice::Current & = Ice::Current()) override {
-        auto it = remove(passengers.begin(), passengers.end(), p);
-        if (it != passengers.end()) {
-            passengers.erase(it, passengers.end());
-            cout << "passenger unregistered from tram " << endl;
-        }
-    }
-
-    virtual string getStockNumber(const Ice::Current & = Ice::Current()) override {
-        return stockNumber;
-    }
-
-    TramPrx selfProxy;
-
-    void setSelfProxy(const TramPrx &proxy) {
-        selfProxy = proxy;
-    }
-
-    bool moveToNextStop() {
-        if (!line || !selfProxy) {
-            cerr << "cant move no line or proxy" << endl;
-            return false;
-        }
-
-        StopList stops = line->getStops();
-        if (stops.empty() || currentStopIndex + 1 >= static_cast<int>(stops.size())) {
-            cout << "end reached" << endl;
-            return false;
-        }
-
-        currentStopIndex++;
-        currentStop = stops[currentStopIndex].stop;
-
-        Time arrivalTime = getCurrentTime();
-        cout << "Arrived at stop: " << currentStop->getName()
-             << " at " << arrivalTime.hour << ":" << arrivalTime.minute << endl;
-
-        try {
-            currentStop->UpdateTramInfo(selfProxy, arrivalTime);
-            updateTimeAtStops();
-            notifyPassengers();
-            return true;
-        } catch (const exception &ex) {
-            cerr << "update failed: " << endl;
-            return false;
-        }
-    }
-    Time getCurrentTime() {
-        auto now = chrono::system_clock::now();
-        time_t nowT = chrono::system_clock::to_time_t(now);
-        tm *timeinfo = localtime(&nowT);
-
-        Time t;
-        t.hour = timeinfo->tm_hour;
-        t.minute = timeinfo->tm_min;
-        return t;
-    }
-
-
-
-
-    string getCurrentStopName() {
-        if (!currentStop) return "not at a stop";
-        return currentStop->getName();
-    }
-
-private:
-    void updateTimeAtStops() {
-        if (!line) return;
-
-        StopList allStops = line->getStops();
-        if (currentStopIndex < 0 || currentStopIndex >= static_cast<int>(allStops.size())) return;
-
-        auto baseTime = std::chrono::system_clock::now();
-
-        for (int i = currentStopIndex + 1; i < allStops.size(); ++i) {
-            int minutesToAdd = (i - currentStopIndex) * 5;
-            auto futureTime = baseTime + std::chrono::minutes(minutesToAdd);
-            std::time_t futureTimeT = std::chrono::system_clock::to_time_t(futureTime);
-            std::tm *timeinfo = std::localtime(&futureTimeT);
-
-            Time estimatedTime;
-            estimatedTime.hour = timeinfo->tm_hour;
-            estimatedTime.minute = timeinfo->tm_min;
-
-            try {
-                allStops[i].stop->UpdateTramInfo(selfProxy, estimatedTime);
-            } catch (const std::exception &ex) {
-                std::cerr << "cant update stop " << allStops[i].stop << std::endl;
-            }
-        }
-    }
-
-
-
-    void notifyPassengers() {
-        StopList upcomingStops = getNextStops(3);
-        vector<PassengerPrx> passengersCopy;
-        {
-            passengersCopy = passengers;
-        }
-
-        for (auto &passenger: passengersCopy) {
-            try {
-                passenger->updateTramInfo(selfProxy, upcomingStops);
-            } catch (const exception &ex) {
-                cerr << "Failed to update passenger: " << ex.what() << endl;
-            }
-        }
-    }
-};
-
-
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         cerr << "Usage: " << argv[0] << " <stock_number>" << endl;
@@ -214,7 +39,8 @@ int main(int argc, char *argv[]) {
 
         Ice::ObjectAdapterPtr adapter = ic->createObjectAdapterWithEndpoints("TramAdapter", endpoint.str());
 
-        TramImpl *tramImpl = new TramImpl(stockNumber);
+        TramImpl *tramImpl = new TramImpl(stockNumber,
+                                          ic->getProperties()->getPropertyAsIntWithDefault("MPK.Notify.MaxFailures", 3));
         Ice::ObjectPtr tramObj = tramImpl;
 
         string tramIdentity = "Tram" + stockNumber;
@@ -226,6 +52,7 @@ int main(int argc, char *argv[]) {
         TramPrx tramProxy = TramPrx::uncheckedCast(adapter->createProxy(Ice::stringToIdentity(tramIdentity)));
 
         tramImpl->setSelfProxy(tramProxy);
+        tramImpl->setStopsCheck(ic->getProperties()->getPropertyAsIntWithDefault("MPK.Tram.StopsCheckMs", 10000));
 
         MPKPrx mpkProxy;
         try {
@@ -0,0 +1,408 @@
+#ifndef TRAM_H
+#define TRAM_H
+
+#include <Ice/Ice.h>
+#include <SIP.h>
+#include <Timetable.h>
+#include <Subscription.h>
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <limits>
+#include <algorithm>
+
+// Tram servant, shared by the tram process and the stress test.
+
+using namespace SIP;
+
+class TramImpl : public Tram {
+    struct Subscriber {
+        PassengerPrx proxy;
+        bool inFlight = false;
+        bool hasPending = false;
+        StopList pending;
+        int failures = 0;
+        bool filtered = false;
+        SubscriptionFilter filter;
+        StopList lastSent;
+    };
+
+    class Delivery : public IceUtil::Shared {
+        Ice::ObjectPtr tram;
+        std::string key;
+    public:
+        Delivery(TramImpl *t, const std::string &k) : tram(t), key(k) {}
+
+        void completed(const Ice::AsyncResultPtr &r) {
+            bool ok = true;
+            try {
+                PassengerPrx::uncheckedCast(r->getProxy())->end_updateTramInfo(r);
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "update of passenger " << key << " failed: " << ex << std::endl;
+                ok = false;
+            }
+            dynamic_cast<TramImpl*>(tram.get())->delivered(key, ok);
+        }
+    };
+
+    std::string stockNumber;
+    int maxFailures;
+    TramStopPrx currentStop;
+    std::string currentStopName;
+    LinePrx line;
+    std::string lineName;
+    int currentStopIndex = -1;
+    // numbers the moves, so stops can tell a late update from a newer one
+    Ice::Long moves = 0;
+    std::mutex passengersMtx;
+    std::map<std::string, Subscriber> passengers;
+    std::mutex stopsMtx;
+    StopList cachedStops;
+    Timetable cachedTimetable;
+    Ice::Long cachedStopsVersion = -1;
+    Ice::Long lastVersionCheck = 0;
+    int stopsCheckMs = 10000;
+
+    StopList cachedLocked(Timetable *timetable) {
+        if (timetable)
+            *timetable = cachedTimetable;
+        return cachedStops;
+    }
+
+    // local copy of the line's stops and their timetable, refreshed by
+    // stopsChanged pushes. Pushes are oneway and can be lost, so at most
+    // every stopsCheckMs the cached version is compared with the line's;
+    // the stops are only fetched when no version is known yet or the line
+    // has a newer one.
+    StopList lineStops(Timetable *timetable = nullptr) {
+        LinePrx l;
+        Ice::Long known = -1;
+        {
+            std::lock_guard<std::mutex> lock(stopsMtx);
+            if (cachedStopsVersion >= 0) {
+                Ice::Long now = nowMs();
+                if (stopsCheckMs <= 0 || now - lastVersionCheck < stopsCheckMs)
+                    return cachedLocked(timetable);
+                lastVersionCheck = now;
+                known = cachedStopsVersion;
+            }
+            l = line;
+        }
+        if (!l)
+            return StopList();
+
+        if (known >= 0) {
+            Ice::Long latest = known;
+            try {
+                latest = l->getStopsVersion();
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "cant check stops version: " << ex << std::endl;
+            }
+            std::lock_guard<std::mutex> lock(stopsMtx);
+            if (latest <= cachedStopsVersion && line == l)
+                return cachedLocked(timetable);
+        }
+
+        Ice::Long version;
+        StopList fetched = l->getStopsVersioned(version);
+        Timetable built(fetched);
+        if (timetable)
+            *timetable = built;
+
+        std::lock_guard<std::mutex> lock(stopsMtx);
+        if (line == l && version > cachedStopsVersion) {
+            cachedStops = fetched;
+            cachedTimetable = built;
+            cachedStopsVersion = version;
+            lastVersionCheck = nowMs();
+        }
+        return fetched;
+    }
+
+public:
+    TramImpl(const std::string &sn, int failures = 3) : stockNumber(sn), maxFailures(std::max(failures, 1)) {}
+
+    // how often the stop list version is checked with the line, 0 never
+    void setStopsCheck(int ms) {
+        std::lock_guard<std::mutex> lock(stopsMtx);
+        stopsCheckMs = ms;
+    }
+
+    virtual TramStopPrx getLocation(const Ice::Current & = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(stopsMtx);
+        return currentStop;
+    }
+
+    virtual LinePrx getLine(const Ice::Current & = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(stopsMtx);
+        return line;
+    }
+
+    virtual void setLine(const LinePrx &l, const Ice::Current & = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(stopsMtx);
+        line = l;
+        lineName = l ? l->ice_getIdentity().name : std::string();
+        currentStopIndex = -1;
+        cachedStops.clear();
+        cachedTimetable = Timetable();
+        cachedStopsVersion = -1;
+    }
+
+    virtual void stopsChanged(const LinePrx &l, Ice::Long version, const StopList &stops, const Ice::Current & = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(stopsMtx);
+        if (!line || !l || line->ice_getIdentity() != l->ice_getIdentity())
+            return;
+        if (version <= cachedStopsVersion)
+            return;
+        cachedStops = stops;
+        cachedTimetable = Timetable(stops);
+        cachedStopsVersion = version;
+        std::cout << "stops of line changed (version " << version << ")" << std::endl;
+    }
+
+    virtual StopList getNextStops(int howMany, const Ice::Current & = Ice::Current()) override {
+        StopList result;
+
+        int index;
+        {
+            std::lock_guard<std::mutex> lock(stopsMtx);
+            if (!line || currentStopIndex < 0)
+                return result;
+            index = currentStopIndex;
+        }
+
+        Timetable timetable;
+        StopList allStops = lineStops(&timetable);
+        if (allStops.empty() || index >= static_cast<int>(allStops.size()))
+            return result;
+
+        Ice::Long now = nowMs();
+        for (int i = index + 1; i < allStops.size() && result.size() < howMany; ++i) {
+            StopInfo stopWithTime = allStops[i];
+            stopWithTime.time = timetable.eta(now, index, i);
+            result.push_back(stopWithTime);
+        }
+
+        return result;
+    }
+
+
+    static std::string keyOf(const PassengerPrx &p) {
+        Ice::Identity id = p->ice_getIdentity();
+        return id.category + "/" + id.name;
+    }
+
+    virtual void RegisterPassenger(const PassengerPrx &p, const Ice::Current &current = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(passengersMtx);
+        Subscriber &s = passengers[keyOf(p)];
+        s.proxy = callbackProxy(p, current);
+        s.failures = 0;
+        s.filtered = false;
+        std::cout << "passenger registered on tram " << std::endl;
+    }
+
+    // maxTrams of the filter limits the number of upcoming stops, a passenger
+    // filtering on other lines than the tram's gets empty updates
+    virtual void RegisterPassengerFiltered(const PassengerPrx &p, const SubscriptionFilter &filter, const Ice::Current &current = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(passengersMtx);
+        Subscriber &s = passengers[keyOf(p)];
+        s.proxy = callbackProxy(p, current);
+        s.failures = 0;
+        s.filtered = true;
+        s.filter = filter;
+        s.lastSent.clear();
+        std::cout << "passenger registered on tram with a filter" << std::endl;
+    }
+
+    virtual void UnregisterPassenger(const PassengerPrx &p, const Ice::Current &current = Ice::Current()) override {
+        std::lock_guard<std::mutex> lock(passengersMtx);
+        if (passengers.erase(keyOf(p)))
+            std::cout << "passenger unregistered from tram " << std::endl;
+    }
+
+    virtual std::string getStockNumber(const Ice::Current & = Ice::Current()) override {
+        return stockNumber;
+    }
+
+    TramPrx selfProxy;
+
+    void setSelfProxy(const TramPrx &proxy) {
+        selfProxy = proxy;
+    }
+
+    // the stop index only moves under stopsMtx, the updates are sent for
+    // the index this call moved to
+    bool moveToNextStop() {
+        {
+            std::lock_guard<std::mutex> lock(stopsMtx);
+            if (!line || !selfProxy) {
+                std::cerr << "cant move no line or proxy" << std::endl;
+                return false;
+            }
+        }
+
+        StopList stops = lineStops();
+        int index;
+        Ice::Long move;
+        std::string stopName;
+        {
+            std::lock_guard<std::mutex> lock(stopsMtx);
+            if (stops.empty() || currentStopIndex + 1 >= static_cast<int>(stops.size())) {
+                std::cout << "end reached" << std::endl;
+                return false;
+            }
+            index = ++currentStopIndex;
+            move = ++moves;
+            currentStop = stops[index].stop;
+            currentStopName = stops[index].name;
+            stopName = currentStopName;
+        }
+
+        Timestamp arrivalTime = getCurrentTime();
+        std::cout << "Arrived at stop: " << stopName
+             << " at " << formatClock(arrivalTime) << std::endl;
+
+        try {
+            updateTimeAtStops(arrivalTime, index, move);
+            notifyPassengers();
+            return true;
+        } catch (const std::exception &ex) {
+            std::cerr << "update failed: " << std::endl;
+            return false;
+        }
+    }
+    // the arrival time sent for a move, the benchmark stamps its own
+    virtual Timestamp getCurrentTime() {
+        return timestamp(nowMs());
+    }
+
+
+
+
+    std::string getCurrentStopName() {
+        std::lock_guard<std::mutex> lock(stopsMtx);
+        if (!currentStop) return "not at a stop";
+        return currentStopName;
+    }
+
+private:
+    void updateTimeAtStops(const Timestamp &arrivalTime, int index, Ice::Long move) {
+        std::string name;
+        {
+            std::lock_guard<std::mutex> lock(stopsMtx);
+            if (!line) return;
+            name = lineName;
+        }
+
+        Timetable timetable;
+        StopList allStops = lineStops(&timetable);
+        if (index < 0 || index >= static_cast<int>(allStops.size())) return;
+
+        ArrivalList updates;
+        updates.reserve(allStops.size() - index);
+        updates.push_back(ArrivalUpdate{allStops[index].stop, selfProxy, arrivalTime, stockNumber, name, move});
+
+        for (int i = index + 1; i < allStops.size(); ++i)
+            updates.push_back(ArrivalUpdate{allStops[i].stop, selfProxy, timetable.eta(arrivalTime.ms, index, i), stockNumber, name, move});
+
+        sendArrivals(updates);
+    }
+
+    // groups the updates by the endpoints of the stop proxies and sends one
+    // oneway batch per server process, the receiving stop applies the rest locally
+    void sendArrivals(const ArrivalList &updates) {
+        std::map<std::string, ArrivalList> byServer;
+        for (const auto &u : updates)
+            byServer[serverKey(u.stop)].push_back(u);
+
+        for (const auto &kv : byServer) {
+            try {
+                TramStopPrx target = TramStopPrx::uncheckedCast(kv.second.front().stop->ice_oneway());
+                target->UpdateTramInfoBatch(kv.second);
+            } catch (const Ice::Exception &ex) {
+                std::cerr << "cant send arrivals to " << kv.first << ": " << ex << std::endl;
+            }
+        }
+    }
+
+
+
+    // Every passenger has at most one update in flight. A newer update
+    // replaces the one waiting behind it, so a slow passenger only ever gets
+    // the latest stops. After maxFailures failed calls in a row the passenger
+    // is dropped. Filtered passengers only get an update when their view
+    // changed materially.
+    void notifyPassengers() {
+        StopList upcomingStops = getNextStops(std::numeric_limits<int>::max());
+        std::string line;
+        {
+            std::lock_guard<std::mutex> lock(stopsMtx);
+            line = lineName;
+        }
+        StopList firstStops(upcomingStops.begin(), upcomingStops.begin() + std::min<size_t>(3, upcomingStops.size()));
+        Ice::Long now = nowMs();
+        std::vector<std::string> ready;
+        {
+            std::lock_guard<std::mutex> lock(passengersMtx);
+            for (auto &kv : passengers) {
+                if (kv.second.filtered) {
+                    StopList view = filterStops(upcomingStops, line, kv.second.filter, now);
+                    if (!changedMaterially(kv.second.lastSent, view, kv.second.filter.minChangeMs))
+                        continue;
+                    kv.second.lastSent = view;
+                    kv.second.pending = view;
+                } else {
+                    kv.second.pending = firstStops;
+                }
+                kv.second.hasPending = true;
+                if (!kv.second.inFlight)
+                    ready.push_back(kv.first);
+            }
+        }
+        for (const auto &key : ready)
+            sendPending(key);
+    }
+
+    void sendPending(const std::string &key) {
+        PassengerPrx proxy;
+        StopList stops;
+        {
+            std::lock_guard<std::mutex> lock(passengersMtx);
+            auto it = passengers.find(key);
+            if (it == passengers.end() || it->second.inFlight || !it->second.hasPending)
+                return;
+            proxy = it->second.proxy;
+            stops.swap(it->second.pending);
+            it->second.hasPending = false;
+            it->second.inFlight = true;
+        }
+        try {
+            IceUtil::Handle<Delivery> cb = new Delivery(this, key);
+            proxy->begin_updateTramInfo(selfProxy, stops, Ice::newCallback(cb, &Delivery::completed));
+        } catch (const Ice::Exception &ex) {
+            std::cerr << "cant update passenger " << key << ": " << ex << std::endl;
+            delivered(key, false);
+        }
+    }
+
+    void delivered(const std::string &key, bool ok) {
+        {
+            std::lock_guard<std::mutex> lock(passengersMtx);
+            auto it = passengers.find(key);
+            if (it == passengers.end())
+                return;
+            it->second.inFlight = false;
+            it->second.failures = ok ? 0 : it->second.failures + 1;
+            if (it->second.failures >= maxFailures) {
+                passengers.erase(it);
+                std::cout << "passenger " << key << " dropped after " << maxFailures << " failed updates" << std::endl;
+                return;
+            }
+        }
+        sendPending(key);
+    }
+};
+
+#endif